@@ -30,14 +30,21 @@
 #include <sys/mac_provider.h>
 #include <sys/mac_ether.h>
 #include <sys/ethernet.h>
+#include <sys/byteorder.h>
 #include <sys/stream.h>
 #include <sys/strsun.h>
+#include <sys/pattr.h>
 #include <sys/virtio.h>
 #include <sys/virtio_ring.h>
 #include <sys/ddi_intr.h>
 #include <sys/ddi.h>
 #include <sys/sunddi.h>
 #include <sys/ddidmareq.h>
+#include <sys/atomic.h>
+#include <sys/ksynch.h>
+#include <sys/sysmacros.h>
+#include <sys/cyclic.h>
+#include <inet/ip.h>
 
 #include "virtionet.h"
 
@@ -50,33 +57,312 @@ typedef struct {
 	uint_t			ccount;
 } virtionet_dma_t;
 
+/* Fixed-size DMA buffer, a piece of a page-sized chunk */
 typedef struct {
+	caddr_t			vb_addr;
+	uint64_t		vb_paddr;	/* device address */
+	ddi_dma_handle_t	vb_hdl;		/* of the chunk */
+	off_t			vb_off;		/* in the chunk */
+} virtionet_buf_t;
+
+/*
+ * Pool of fixed-size DMA buffers. The memory comes in page-sized chunks
+ * from the per instance chunk cache, which binds them when they are
+ * constructed. Buffers never cross a chunk, so every one is a single DMA
+ * segment and no large physically contiguous allocation is needed.
+ */
+typedef struct {
+	virtionet_dma_t		**vp_chunks;
+	uint_t			vp_nchunks;
+	virtionet_buf_t		*vp_bufs;
+	uint_t			vp_nbufs;
+	size_t			vp_bufsize;
+} virtionet_pool_t;
+
+/* Padding that keeps data updated from different places off one line */
+#define	VIRTIONET_CACHE_LINE	64
+
+/*
+ * Virtqueue, split or packed (VIRTIO_F_RING_PACKED). Chains are built in
+ * vr_desc either way, for a packed ring it is a driver private table the
+ * chains are copied from into the ring when they are pushed.
+ * The ring indices are kept in driver private shadows, the shared ring
+ * is only written to publish them and never read back. The fields the
+ * producer and the completion side update are a cache line apart.
+ */
+typedef struct {
+	/* Set up once */
 	uint16_t		vq_num;
 	uint16_t		vq_size;
+	uint16_t		vq_max_size;	/* offered by the device */
+	boolean_t		vq_event_idx;	/* VIRTIO_F_RING_EVENT_IDX */
+	boolean_t		vq_packed;	/* VIRTIO_F_RING_PACKED */
 	virtionet_dma_t		vq_dma;
 	vring_desc_t		*vr_desc;
 	vring_avail_t		*vr_avail;
 	vring_used_t		*vr_used;
+	vring_packed_desc_t	*vr_pdesc;	/* packed descriptor ring */
+	vring_packed_event_t	*vr_drv_event;
+	vring_packed_event_t	*vr_dev_event;
+	uint16_t		*vq_chainlen;	/* ring slots, by buffer ID */
+	off_t			vq_avail_off;	/* of vr_avail/vr_drv_event */
+	off_t			vq_used_off;	/* of vr_used/vr_dev_event */
+	caddr_t			vq_notify;	/* modern transport doorbell */
+	uint8_t			vq_pad0[VIRTIONET_CACHE_LINE];
+
+	/* Producer side */
+	uint16_t		vq_free_head;	/* first free descriptor */
+	uint16_t		vq_nfree;	/* number of free descriptors */
+	uint16_t		vq_avail_idx;	/* chains published */
+	uint16_t		vq_npushed;	/* pushed, not yet published */
+	uint16_t		vq_kick_idx;	/* avail idx at last notify */
+	uint16_t		vq_avail_pos;	/* next packed slot to fill */
+	uint16_t		vq_avail_wrap;	/* its wrap counter */
+	uint16_t		vq_nadded;	/* slots filled since notify */
+	uint8_t			vq_pad1[VIRTIONET_CACHE_LINE];
+
+	/* Completion side */
+	uint16_t		vq_last_used;	/* completions taken */
+	uint16_t		vq_used_idx;	/* last read vr_used->idx */
+	uint16_t		vq_used_pos;	/* next packed slot used */
+	uint16_t		vq_used_wrap;	/* its wrap counter */
+	uint16_t		vq_avail_flags;	/* vr_avail->flags */
 } virtqueue_t;
 
+/* Chains pushed and not completed yet */
+#define	VQ_NINFLIGHT(vqp)	\
+	((uint16_t)((vqp)->vq_avail_idx + (vqp)->vq_npushed - \
+	(vqp)->vq_last_used))
+
+/*
+ * Interrupt moderation state of a queue, protected by the ring lock.
+ * While im_on is set the queue doesn't interrupt and the moderation timer
+ * processes it every im_interval.
+ */
+typedef struct {
+	boolean_t		im_on;
+	hrtime_t		im_interval;
+	hrtime_t		im_ts;		/* start of the rate sample */
+	uint64_t		im_count;	/* packets before the sample */
+	uint64_t		im_rate;	/* packets/s, smoothed */
+} virtionet_imod_t;
+
+/*
+ * Rx buffer from the pool of its ring. Buffers holding large frames are
+ * loaned up the stack with desballoc() and come back through rb_frtn.
+ */
+typedef struct virtionet_rxbuf {
+	virtionet_buf_t		*rb_buf;
+	frtn_t			rb_frtn;
+	struct virtionet_rxring	*rb_rxr;
+	struct virtionet_rxbuf	*rb_next;	/* free/recycle list link */
+} virtionet_rxbuf_t;
+
+/* Pre-allocated DMA handle used to bind outgoing mblk fragments */
+typedef struct virtionet_txdmah {
+	ddi_dma_handle_t	hdl;
+	struct virtionet_txdmah	*next;
+} virtionet_txdmah_t;
+
+/* Tx state of a packet in flight, indexed by its head descriptor */
+typedef struct {
+	mblk_t			*ts_mp;		/* freed on reclaim */
+	virtionet_txdmah_t	*ts_dmah;	/* bound DMA handles */
+} virtionet_txslot_t;
+
+/* Part of a received frame: a buffer and the number of bytes in it */
 typedef struct {
+	virtionet_rxbuf_t	**rf_slot;	/* its rr_slots entry */
+	uint32_t		rf_len;
+	uint16_t		rf_head;	/* Rx slot the buffer is on */
+} virtionet_rxfrag_t;
+
+/* Most buffers a single received frame may span */
+#define	VIRTIONET_RX_MAXFRAGS	32
+
+/* No byte budget for virtionet_rx(), harvest the whole used ring */
+#define	VIRTIONET_RX_NOLIMIT	0
+
+/* Most Rx/Tx queue pairs used, one MAC ring each way */
+#define	VIRTIONET_MAX_QPAIRS	16
+
+/*
+ * Control buffers. Commands are issued one at a time, but one that timed
+ * out keeps its buffer as the device may still write the ack.
+ */
+#define	VIRTIONET_CTRL_NBUFS	4
+
+/* ctl_heads[] entry of a control buffer no command is using */
+#define	VIRTIONET_CTRL_FREE	0xFFFF
+
+/*
+ * MSI-X vectors: config changes, shared with the control queue, then
+ * one for each Rx and Tx queue.
+ */
+#define	VIRTIONET_MSIX_CFG	0
+#define	VIRTIONET_MSIX_RX(i)	(1 + 2 * (i))
+#define	VIRTIONET_MSIX_TX(i)	(2 + 2 * (i))
+#define	VIRTIONET_MSIX_NVEC(n)	(1 + 2 * (n))
+#define	VIRTIONET_MAX_INTRS	VIRTIONET_MSIX_NVEC(VIRTIONET_MAX_QPAIRS)
+
+/*
+ * Receive queue with its buffers, exposed to MAC as an Rx ring.
+ * rr_lock protects the virtqueue, the slots and the spare buffers, it is
+ * dropped around mac_rx_ring().
+ */
+typedef struct virtionet_rxring {
+	kmutex_t		rr_lock;
+	struct virtionet_state	*rr_sp;
+	virtqueue_t		*rr_vq;
+	uint_t			rr_index;
+	virtionet_rxbuf_t	*rr_bufs;	/* all Rx buffers */
+	uint_t			rr_nbufs;
+	virtionet_pool_t	*rr_pool;	/* their memory */
+	virtionet_rxbuf_t	**rr_slots;	/* buffers posted per slot */
+	virtionet_pool_t	*rr_ind;	/* Rx indirect tables */
+	uint_t			rr_nslots;	/* Rx slots posted */
+	virtionet_rxbuf_t	*rr_free;	/* spare buffers */
+	virtionet_rxbuf_t	*rr_recycle;	/* returned by the stack */
+	virtionet_rxfrag_t	rr_frags[VIRTIONET_RX_MAXFRAGS];
+	mac_ring_handle_t	rr_mrh;
+	uint64_t		rr_gen;
+	boolean_t		rr_polling;	/* MAC polls, no interrupts */
+	uint16_t		rr_nwait;	/* used entries to wait for */
+	virtionet_imod_t	rr_imod;
+	ddi_softint_handle_t	rr_softint;	/* delivers missed frames */
+	uint64_t		rr_ipackets;
+	uint64_t		rr_rbytes;
+	uint64_t		rr_norcvbuf;
+	uint64_t		rr_ierrors;
+	uint8_t			rr_pad[VIRTIONET_CACHE_LINE];
+} virtionet_rxring_t;
+
+/*
+ * Transmit queue with its buffers, exposed to MAC as a Tx ring.
+ * tr_lock protects the virtqueue, the slots and the DMA handle pool, it
+ * is dropped around mac_tx_ring_update().
+ */
+typedef struct virtionet_txring {
+	kmutex_t		tr_lock;
+	struct virtionet_state	*tr_sp;
+	virtqueue_t		*tr_vq;
+	uint_t			tr_index;
+	virtionet_pool_t	*tr_buf;	/* per descriptor copy slots */
+	virtionet_pool_t	*tr_ind;	/* Tx indirect tables */
+	virtionet_txslot_t	*tr_slots;
+	virtionet_txdmah_t	*tr_dmah;	/* DMA handle pool */
+	virtionet_txdmah_t	*tr_dmah_free;
+	uint_t			tr_ndmah;
+	boolean_t		tr_blocked;	/* MAC was told to back off */
+	virtionet_imod_t	tr_imod;
+	mac_ring_handle_t	tr_mrh;
+	uint64_t		tr_opackets;
+	uint64_t		tr_obytes;
+	uint64_t		tr_noxmtbuf;
+	uint64_t		tr_oerrors;
+	uint8_t			tr_pad[VIRTIONET_CACHE_LINE];
+} virtionet_txring_t;
+
+/*
+ * Per instance state. The lock serializes start/stop, property changes
+ * and the control queue, the rings have locks of their own.
+ */
+typedef struct virtionet_state {
+	kmutex_t		lock;
 	dev_info_t		*dip;
-	caddr_t			hdraddr;
+	boolean_t		modern;		/* virtio 1.0 PCI transport */
+	caddr_t			hdraddr;	/* legacy header/common cfg */
 	ddi_acc_handle_t	hdrhandle;
 	caddr_t			devaddr;
 	ddi_acc_handle_t	devhandle;
-	virtqueue_t		*rxq;
-	virtqueue_t		*txq;
+	caddr_t			israddr;	/* modern only */
+	ddi_acc_handle_t	isrhandle;
+	caddr_t			notifyaddr;	/* modern only */
+	ddi_acc_handle_t	notifyhandle;
+	uint32_t		notify_mult;	/* notify_off_multiplier */
+	virtionet_rxring_t	*rxrings;
+	virtionet_txring_t	*txrings;
+	uint_t			nqpairs;	/* Rx/Tx queue pairs used */
+	uint_t			max_qpairs;	/* offered by the device */
 	virtqueue_t		*ctlq;
-	virtionet_dma_t		*rxbuf;
-	virtionet_dma_t		*txbuf;
-	virtionet_dma_t		*ctlbuf;
-	ddi_intr_handle_t	ihandle;
-	uint32_t		features;
+	size_t			rx_bufsize;
+	size_t			rx_bufoff;	/* device data offset */
+	uint_t			rx_slotbufs;	/* buffers per Rx slot */
+	uint16_t		rxq_size;	/* requested, 0 for max */
+	uint16_t		txq_size;
+	uint16_t		ctlq_size;
+	uint32_t		rx_nloaned;
+	boolean_t		rx_noloan;	/* copy, a reset is coming */
+	kmutex_t		ctl_lock;	/* one command at a time */
+	virtionet_pool_t	*ctlbuf;	/* commands in flight */
+	uint16_t		ctl_heads[VIRTIONET_CTRL_NBUFS]; /* chains */
+	kmem_cache_t		*chunk_cache;	/* DMA chunks of all pools */
+	ddi_intr_handle_t	ihandles[VIRTIONET_MAX_INTRS];
+	int			intr_type;
+	int			intr_count;
+	int			intr_cap;
+	uint_t			intr_pri;	/* of all the ring locks */
+	kmutex_t		imod_lock;	/* arms the moderation timer */
+	cyclic_id_t		imod_cyclic;
+	uint_t			imod_nqueues;	/* moderated right now */
+	uint_t			imod_mode;
+	uint32_t		imod_high;	/* packets per second */
+	uint32_t		imod_low;
+	uint32_t		imod_usec;	/* longest timer interval */
+	uint64_t		features;
+	size_t			hdrlen;		/* virtio net header size */
 	mac_handle_t		mh;
+	uint32_t		mtu;
+	uint32_t		max_mtu;
+	boolean_t		started;
+	boolean_t		unicst_set;	/* the one address filter */
 	ether_addr_t		addr;
 } virtionet_state_t;
 
+/* Size of a single Rx/Tx buffer slot */
+#define	VIRTIONET_BUFSZ		2048
+
+/* Offset to make IP header 4-byte aligned in the received mblk */
+#define	VIRTIONET_IPHDR_ALIGN	2
+
+/* Maximum number of data descriptors for a single bound Tx packet */
+#define	VIRTIONET_TX_MAXSEGS	32
+
+/* Largest frame the device may coalesce in large receive mode */
+#define	VIRTIONET_LRO_MAXLEN	(65535 + sizeof (struct ether_vlan_header))
+
+/* Control queue buffer of a single command, the ack is the last byte */
+#define	VIRTIONET_CTRL_BUFSZ	128
+
+/* How long to wait for a control command to complete, in milliseconds */
+#define	VIRTIONET_CTRL_TIMEOUT	1000
+
+/* Interrupt moderation modes */
+#define	VIRTIONET_IMOD_OFF		0
+#define	VIRTIONET_IMOD_ADAPTIVE		1
+#define	VIRTIONET_IMOD_FIXED		2
+#define	VIRTIONET_IMOD_NMODES		3
+
+/* Packet rates are sampled every millisecond */
+#define	VIRTIONET_IMOD_SAMPLE		(NANOSEC / 1000)
+
+/* Shortest moderation timer interval, in microseconds */
+#define	VIRTIONET_IMOD_MIN_USEC		10
+
+/* Queue sizes that can be asked for, the largest is the virtio limit */
+#define	VIRTIONET_MIN_QSIZE	64
+#define	VIRTIONET_MAX_QSIZE	32768
+
+/* Largest MTU unless the device reports its own limit (VIRTIO_NET_F_MTU) */
+#define	VIRTIONET_MAX_MTU	9000
+
+/* Largest TCP segment handed to the device for segmentation */
+#define	VIRTIONET_LSO_MAXLEN	65535
+
+/* Size of the per-slot Tx indirect table: the header plus the data */
+#define	VIRTIONET_TX_INDIRECT_SIZE	\
+	(sizeof (vring_desc_t) * (VIRTIONET_TX_MAXSEGS + 1))
+
 
 #define	VIRTIO_GET8(sp, x)	ddi_get8(sp->hdrhandle, \
 				    (uint8_t *)(sp->hdraddr + x))
@@ -94,21 +380,99 @@ typedef struct {
 				    (uint32_t *)(sp->hdraddr + x), \
 				    (uint32_t)(v))
 
+/* Registers both transports have, at different offsets */
+#define	VIRTIO_REG(sp, r)	\
+	((sp)->modern ? VIRTIO_COMMON_##r : VIRTIO_##r)
+
+/* Status bits accumulate until the device is reset */
+#define	VIRTIO_DEV_STATUS(sp)	\
+	VIRTIO_GET8(sp, VIRTIO_REG(sp, DEVICE_STATUS))
+#define	VIRTIO_DEV_SET(sp, s)	\
+	VIRTIO_PUT8(sp, VIRTIO_REG(sp, DEVICE_STATUS), \
+	    VIRTIO_DEV_STATUS(sp) | (s))
+
 #define	VIRTIO_DEV_RESET(sp)	\
-	VIRTIO_PUT8(sp, VIRTIO_DEVICE_STATUS, 0)
+	VIRTIO_PUT8(sp, VIRTIO_REG(sp, DEVICE_STATUS), 0)
 #define	VIRTIO_DEV_ACK(sp)	\
-	VIRTIO_PUT8(sp, VIRTIO_DEVICE_STATUS, VIRTIO_DEV_STATUS_ACK)
+	VIRTIO_DEV_SET(sp, VIRTIO_DEV_STATUS_ACK)
 #define	VIRTIO_DEV_DRIVER(sp)	\
-	VIRTIO_PUT8(sp, VIRTIO_DEVICE_STATUS, VIRTIO_DEV_STATUS_DRIVER)
+	VIRTIO_DEV_SET(sp, VIRTIO_DEV_STATUS_DRIVER)
 #define	VIRTIO_DEV_DRIVER_OK(sp)\
-	VIRTIO_PUT8(sp, VIRTIO_DEVICE_STATUS, VIRTIO_DEV_STATUS_DRIVER_OK)
+	VIRTIO_DEV_SET(sp, VIRTIO_DEV_STATUS_DRIVER_OK)
 #define	VIRTIO_DEV_FAILED(sp)	\
-	VIRTIO_PUT8(sp, VIRTIO_DEVICE_STATUS, VIRTIO_DEV_STATUS_FAILED)
+	VIRTIO_DEV_SET(sp, VIRTIO_DEV_STATUS_FAILED)
+
+#define	VIRTIO_ISR(sp)	((sp)->modern ? \
+	ddi_get8((sp)->isrhandle, (uint8_t *)(sp)->israddr) : \
+	VIRTIO_GET8(sp, VIRTIO_ISR_STATUS))
+
+/* The modern doorbell is an MMIO write to the queue's notify address */
+#define	VIRTIO_VQ_NOTIFY(sp, vqp)	((sp)->modern ? \
+	ddi_put16((sp)->notifyhandle, (uint16_t *)(vqp)->vq_notify, \
+	    (vqp)->vq_num) : \
+	VIRTIO_PUT16(sp, VIRTIO_QUEUE_NOTIFY, (vqp)->vq_num))
 
-#define	VIRTIO_ISR(sp)	VIRTIO_GET8(sp, VIRTIO_ISR_STATUS)
+/* Highest ring address the legacy 32 bit page number register takes */
+#define	VIRTIO_VQ_LEGACY_ADDR_HI	\
+	(0x100000000ULL * VIRTIO_VQ_PCI_ALIGN - 1)
 
 static void *virtionet_statep;
 
+static int virtionet_set_mtu(virtionet_state_t *, uint32_t);
+static int virtionet_priv_setprop(virtionet_state_t *, const char *,
+    const void *);
+static mblk_t *virtionet_rx(virtionet_rxring_t *, int);
+
+/*
+ * Number of free Tx descriptors required before a blocked transmit is
+ * restarted with mac_tx_ring_update(). It is capped at half of the ring
+ * size.
+ */
+uint_t virtionet_tx_resched_thresh = 64;
+
+/*
+ * Tx packets up to this size are copied into the pre-mapped Tx slot,
+ * larger ones have their fragments bound for DMA directly.
+ */
+uint_t virtionet_tx_copybreak = 256;
+
+/*
+ * Rx frames up to this size are copied into a new mblk and the buffer
+ * stays on the ring, larger ones are loaned up the stack.
+ */
+uint_t virtionet_rx_copybreak = 256;
+
+/* Spare Rx buffers, per posted Rx buffer, used to replace loaned ones */
+uint_t virtionet_rx_spare_ratio = 1;
+
+/*
+ * Interrupt moderation defaults, the private properties change them per
+ * instance. In adaptive mode a queue handling more than
+ * virtionet_imod_high_rate packets per second stops interrupting and is
+ * processed from a timer, until its rate drops below
+ * virtionet_imod_low_rate. The timer aims at virtionet_imod_batch packets
+ * per run, but never waits longer than virtionet_imod_usec. In fixed mode
+ * every queue is processed every virtionet_imod_usec.
+ */
+uint_t virtionet_imod_mode = VIRTIONET_IMOD_ADAPTIVE;
+uint_t virtionet_imod_high_rate = 40000;
+uint_t virtionet_imod_low_rate = 10000;
+uint_t virtionet_imod_usec = 100;
+uint_t virtionet_imod_batch = 16;
+
+/*
+ * Maximum number of 64 KB Rx slots posted in large receive mode when
+ * indirect descriptors let every slot take a single ring descriptor.
+ */
+uint_t virtionet_rx_lro_slots = 64;
+
+/*
+ * Upper limit on the Rx/Tx queue pairs used, 0 means one per CPU. The
+ * device, VIRTIONET_MAX_QPAIRS and the MSI-X vectors available may
+ * lower it further.
+ */
+uint_t virtionet_qpairs = 0;
+
 static link_state_t
 virtionet_link_status(virtionet_state_t *sp)
 {
@@ -136,899 +500,4485 @@ virtionet_link_status(virtionet_state_t *sp)
 }
 
 
-/* Enqueue a single packet 'mp' for sending */
-static boolean_t
-virtionet_send(virtionet_state_t *sp, mblk_t *mp)
+/*
+ * Take a chain of 'n' descriptors off the virtqueue free list.
+ * The descriptors are linked with VRING_DESC_F_NEXT in the order they are
+ * returned, the caller has to make sure there are enough free ones.
+ * The head descriptor identifies the chain until it is freed, on a packed
+ * ring it is the buffer ID.
+ */
+static uint16_t
+virtio_vq_alloc_chain(virtqueue_t *vqp, uint_t n)
 {
-	void			*buf;
-	size_t			mlen;
-	int			idx;
+	uint16_t		head;
+	uint16_t		idx;
 
-	ASSERT(mp != NULL);
+	ASSERT(n > 0);
+	ASSERT(n <= vqp->vq_nfree);
 
-	mlen = msgsize(mp);
+	head = idx = vqp->vq_free_head;
+	for (uint_t i = 1; i < n; i++) {
+		vqp->vr_desc[idx].flags = VRING_DESC_F_NEXT;
+		idx = vqp->vr_desc[idx].next;
+	}
+	vqp->vr_desc[idx].flags = 0;
+
+	vqp->vq_free_head = vqp->vr_desc[idx].next;
+	vqp->vq_nfree -= n;
 
-	ASSERT(mlen <= 2048);
+	return (head);
+}
 
-	cmn_err(CE_CONT, "Sending message of %d bytes\n", mlen);
 
-	idx = sp->txq->vr_avail->idx;
-	buf = sp->txbuf->addr + idx * 2048;
-	mcopymsg(mp, buf);
-	sp->txq->vr_desc[idx].len = mlen;
+/* Return the descriptor chain starting at 'head' to the free list */
+static void
+virtio_vq_free_chain(virtqueue_t *vqp, uint16_t head)
+{
+	uint16_t		idx = head;
+	uint_t			n = 1;
 
-	ddi_dma_sync(sp->txbuf->hdl, idx * 2048, mlen, DDI_DMA_SYNC_FORDEV);
-	sp->txq->vr_avail->idx++;
-	/* The next is suboptimal, should calculate exact offset/size */
-	ddi_dma_sync(sp->txq->vq_dma.hdl, 0, 0, DDI_DMA_SYNC_FORDEV);
+	ASSERT(head < vqp->vq_size);
 
-	return (B_TRUE);
+	while (vqp->vr_desc[idx].flags & VRING_DESC_F_NEXT) {
+		idx = vqp->vr_desc[idx].next;
+		n++;
+	}
+
+	vqp->vr_desc[idx].next = vqp->vq_free_head;
+	vqp->vq_free_head = head;
+	vqp->vq_nfree += n;
+
+	ASSERT(vqp->vq_nfree <= vqp->vq_size);
 }
 
 
 /*
- * MAC callbacks
+ * Fill in entry 'i' of an indirect table of 'n' descriptors. Packed rings
+ * lay the table out in their own descriptor format, without chaining.
  */
-static int
-virtionet_getstat(void *arg, uint_t stat, uint64_t *val)
+static void
+virtio_vq_set_indirect(virtqueue_t *vqp, vring_desc_t *tbl, uint_t i,
+    uint_t n, uint64_t addr, uint32_t len, uint16_t flags)
 {
-	virtionet_state_t	*sp = arg;
-	int			rc = 0;
+	if (vqp->vq_packed) {
+		vring_packed_desc_t	*pdp = (vring_packed_desc_t *)&tbl[i];
 
-	switch (stat) {
-	case MAC_STAT_IFSPEED:
-		*val = 1000 * 1000 * 1000;
-		break;
-	case MAC_STAT_MULTIRCV:
-	case MAC_STAT_BRDCSTRCV:
-	case MAC_STAT_MULTIXMT:
-	case MAC_STAT_BRDCSTXMT:
-	case MAC_STAT_NORCVBUF:
-	case MAC_STAT_IERRORS:
-	case MAC_STAT_UNKNOWNS:
-	case MAC_STAT_NOXMTBUF:
-	case MAC_STAT_OERRORS:
-	case MAC_STAT_COLLISIONS:
-	case MAC_STAT_RBYTES:
-	case MAC_STAT_IPACKETS:
-	case MAC_STAT_OBYTES:
-	case MAC_STAT_OPACKETS:
-	case MAC_STAT_UNDERFLOWS:
-	case MAC_STAT_OVERFLOWS:
-	case ETHER_STAT_ALIGN_ERRORS:
-	case ETHER_STAT_FCS_ERRORS:
-	case ETHER_STAT_FIRST_COLLISIONS:
-	case ETHER_STAT_MULTI_COLLISIONS:
-	case ETHER_STAT_SQE_ERRORS:
-	case ETHER_STAT_DEFER_XMTS:
-	case ETHER_STAT_TX_LATE_COLLISIONS:
-	case ETHER_STAT_EX_COLLISIONS:
-	case ETHER_STAT_MACXMT_ERRORS:
-	case ETHER_STAT_CARRIER_ERRORS:
-	case ETHER_STAT_TOOLONG_ERRORS:
-	case ETHER_STAT_MACRCV_ERRORS:
-	case ETHER_STAT_XCVR_ADDR:
-	case ETHER_STAT_XCVR_ID:
-	case ETHER_STAT_XCVR_INUSE:
-	case ETHER_STAT_CAP_1000FDX:
-	case ETHER_STAT_CAP_1000HDX:
-	case ETHER_STAT_CAP_100FDX:
-	case ETHER_STAT_CAP_100HDX:
-	case ETHER_STAT_CAP_10FDX:
-	case ETHER_STAT_CAP_10HDX:
-	case ETHER_STAT_CAP_ASMPAUSE:
-	case ETHER_STAT_CAP_PAUSE:
-	case ETHER_STAT_CAP_AUTONEG:
-	case ETHER_STAT_ADV_CAP_1000FDX:
-	case ETHER_STAT_ADV_CAP_1000HDX:
-	case ETHER_STAT_ADV_CAP_100FDX:
-	case ETHER_STAT_ADV_CAP_100HDX:
-	case ETHER_STAT_ADV_CAP_10FDX:
-	case ETHER_STAT_ADV_CAP_10HDX:
-	case ETHER_STAT_ADV_CAP_ASMPAUSE:
-	case ETHER_STAT_ADV_CAP_PAUSE:
-	case ETHER_STAT_ADV_CAP_AUTONEG:
-	case ETHER_STAT_LP_CAP_1000FDX:
-	case ETHER_STAT_LP_CAP_1000HDX:
-	case ETHER_STAT_LP_CAP_100FDX:
-	case ETHER_STAT_LP_CAP_100HDX:
-	case ETHER_STAT_LP_CAP_10FDX:
-	case ETHER_STAT_LP_CAP_10HDX:
-	case ETHER_STAT_LP_CAP_ASMPAUSE:
-	case ETHER_STAT_LP_CAP_PAUSE:
-	case ETHER_STAT_LP_CAP_AUTONEG:
-	case ETHER_STAT_LINK_ASMPAUSE:
-	case ETHER_STAT_LINK_PAUSE:
-	case ETHER_STAT_LINK_AUTONEG:
-		rc = ENOTSUP;
-		break;
-	case ETHER_STAT_LINK_DUPLEX:
-		*val = LINK_DUPLEX_FULL;
-		break;
-	default:
-		rc = ENOTSUP;
+		pdp->addr = addr;
+		pdp->len = len;
+		pdp->id = 0;
+		pdp->flags = flags;
+	} else {
+		tbl[i].addr = addr;
+		tbl[i].len = len;
+		tbl[i].flags = flags | ((i + 1 < n) ? VRING_DESC_F_NEXT : 0);
+		tbl[i].next = i + 1;
 	}
-	return (rc);
 }
 
 
-static int
-virtionet_start(void *arg)
-{
-	virtionet_state_t	*sp = arg;
-
-	cmn_err(CE_CONT, "virtionet_start\n");
-
-	VIRTIO_DEV_DRIVER_OK(sp);
-
-	mac_link_update(sp->mh, virtionet_link_status(sp));
-
-	return (0);
-}
+/*
+ * Ring accessors. Each one syncs only the part of the ring it covers, the
+ * driver writes the descriptors, the avail ring and used_event, the
+ * device writes the used ring and avail_event.
+ */
+#define	VQ_AVAIL_RING_OFF(vqp)	\
+	((vqp)->vq_avail_off + offsetof(vring_avail_t, ring))
+#define	VQ_USED_RING_OFF(vqp)	\
+	((vqp)->vq_used_off + offsetof(vring_used_t, ring))
 
+/* Sync 'n' consecutive ring entries of 'esize' bytes, starting at 'from' */
 static void
-virtionet_stop(void *arg)
+virtio_vq_sync_ring(virtqueue_t *vqp, off_t base, size_t esize,
+    uint16_t from, uint16_t n, uint_t type)
 {
-	virtionet_state_t	*sp = arg;
+	uint16_t		start = from % vqp->vq_size;
+	uint16_t		first = MIN(n, vqp->vq_size - start);
 
-	cmn_err(CE_CONT, "virtionet_stop\n");
+	if (first != 0) {
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, base + start * esize,
+		    first * esize, type);
+	}
+	if (n > first) {
+		/* The rest wrapped around to the start of the ring */
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, base,
+		    (n - first) * esize, type);
+	}
 }
 
-static int
-virtionet_setpromisc(void *arg, boolean_t promisc_mode)
+
+/*
+ * Sync the descriptor chain starting at 'head' for the device. Packed
+ * rings keep the chains in driver memory until they are pushed.
+ */
+static void
+virtio_vq_sync_chain(virtqueue_t *vqp, uint16_t head)
 {
-	virtionet_state_t	*sp = arg;
+	uint16_t		idx = head;
 
-	cmn_err(CE_CONT, "virtionet_setpromisc\n");
+	if (vqp->vq_packed) {
+		return;
+	}
 
-	return (0);
+	for (;;) {
+		(void) ddi_dma_sync(vqp->vq_dma.hdl,
+		    idx * sizeof (vring_desc_t), sizeof (vring_desc_t),
+		    DDI_DMA_SYNC_FORDEV);
+		if (!(vqp->vr_desc[idx].flags & VRING_DESC_F_NEXT)) {
+			break;
+		}
+		idx = vqp->vr_desc[idx].next;
+	}
 }
 
-static int
-virtionet_multicst(void *arg, boolean_t add, const uint8_t *mcast_addr)
-{
-	virtionet_state_t	*sp = arg;
-
-	cmn_err(CE_CONT, "virtionet_multicst\n");
 
-	return (0);
+/* Read the used idx the device published */
+static uint16_t
+virtio_vq_used_idx(virtqueue_t *vqp)
+{
+	(void) ddi_dma_sync(vqp->vq_dma.hdl, vqp->vq_used_off,
+	    offsetof(vring_used_t, ring), DDI_DMA_SYNC_FORKERNEL);
+	return (vqp->vr_used->idx);
 }
 
-static int
-virtionet_unicst(void *arg, const uint8_t *ucast_addr)
+
+/* Sync used_event, or the avail flags without event indices */
+static void
+virtio_vq_sync_intr(virtqueue_t *vqp)
 {
-	virtionet_state_t	*sp = arg;
+	if (vqp->vq_packed) {
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, vqp->vq_avail_off,
+		    sizeof (vring_packed_event_t), DDI_DMA_SYNC_FORDEV);
+	} else if (vqp->vq_event_idx) {
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, VQ_AVAIL_RING_OFF(vqp) +
+		    vqp->vq_size * sizeof (uint16_t), sizeof (uint16_t),
+		    DDI_DMA_SYNC_FORDEV);
+	} else {
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, vqp->vq_avail_off,
+		    offsetof(vring_avail_t, ring), DDI_DMA_SYNC_FORDEV);
+	}
+}
 
-	cmn_err(CE_CONT, "virtionet_unicst\n");
 
-	return (0);
-}
+/* Move a packed ring position on by 'n', flipping the wrap counter */
+#define	VQ_PACKED_ADVANCE(vqp, pos, wrap, n)	do {	\
+	(pos) += (n);					\
+	if ((pos) >= (vqp)->vq_size) {			\
+		(pos) -= (vqp)->vq_size;		\
+		(wrap) ^= 1;				\
+	}						\
+	_NOTE(CONSTCOND) } while (0)
 
-static mblk_t *
-virtionet_tx(void *arg, mblk_t *mp)
+/*
+ * Copy the chain starting at 'head' into the packed ring. The head
+ * descriptor is made available last, so the device never sees a partial
+ * chain.
+ */
+static void
+virtio_vq_push_packed(virtqueue_t *vqp, uint16_t head)
 {
-	virtionet_state_t	*sp = arg;
-	mblk_t			*next;
-
-	cmn_err(CE_CONT, "virtionet_tx\n");
+	vring_packed_desc_t	*pdp;
+	vring_desc_t		*dp;
+	uint16_t		idx = head;
+	uint16_t		pos = vqp->vq_avail_pos;
+	uint16_t		wrap = vqp->vq_avail_wrap;
+	uint16_t		hflags = 0;
+	uint16_t		flags;
+	uint16_t		n = 0;
+
+	for (;;) {
+		dp = &vqp->vr_desc[idx];
+		pdp = &vqp->vr_pdesc[pos];
+		flags = dp->flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE |
+		    VRING_DESC_F_INDIRECT);
+		flags |= wrap ? VRING_PACKED_DESC_F_AVAIL :
+		    VRING_PACKED_DESC_F_USED;
+
+		pdp->addr = dp->addr;
+		pdp->len = dp->len;
+		pdp->id = head;
+		if (n == 0) {
+			hflags = flags;
+		} else {
+			pdp->flags = flags;
+		}
+		n++;
+		VQ_PACKED_ADVANCE(vqp, pos, wrap, 1);
 
-	while (mp != NULL) {
-		next = mp->b_next;
-		mp->b_next = NULL;
-		if (virtionet_send(sp, mp) != B_TRUE) {
-			mp->b_next = next;
+		if (!(dp->flags & VRING_DESC_F_NEXT)) {
 			break;
 		}
-		mp = next;
+		idx = dp->next;
 	}
-	return (mp);
+
+	virtio_vq_sync_ring(vqp, 0, sizeof (vring_packed_desc_t),
+	    vqp->vq_avail_pos, n, DDI_DMA_SYNC_FORDEV);
+	membar_producer();
+	vqp->vr_pdesc[vqp->vq_avail_pos].flags = hflags;
+	virtio_vq_sync_ring(vqp, 0, sizeof (vring_packed_desc_t),
+	    vqp->vq_avail_pos, 1, DDI_DMA_SYNC_FORDEV);
+
+	vqp->vq_chainlen[head] = n;
+	vqp->vq_avail_pos = pos;
+	vqp->vq_avail_wrap = wrap;
+	vqp->vq_nadded += n;
 }
 
 
+/*
+ * Queue the chain starting at 'head' for the device. On a split ring it
+ * is not seen until virtio_vq_publish() moves the avail idx.
+ */
 static void
-virtionet_ioctl(void *arg, queue_t *q, mblk_t *mp)
+virtio_vq_push(virtqueue_t *vqp, uint16_t head)
 {
-	virtionet_state_t	*sp = arg;
-
-	cmn_err(CE_CONT, "virtionet_ioctl\n");
+	if (vqp->vq_packed) {
+		virtio_vq_push_packed(vqp, head);
+	} else {
+		vqp->vr_avail->ring[(uint16_t)(vqp->vq_avail_idx +
+		    vqp->vq_npushed) % vqp->vq_size] = head;
+	}
+	vqp->vq_npushed++;
 }
 
+
+/*
+ * Make the chains pushed since the last call visible to the device.
+ * Returns B_FALSE if there were none.
+ */
 static boolean_t
-virtionet_getcapab(void *arg, mac_capab_t cap, void *cap_data)
+virtio_vq_publish(virtqueue_t *vqp)
 {
-	virtionet_state_t	*sp = arg;
-	boolean_t		result;
+	uint16_t		n = vqp->vq_npushed;
 
-	switch (cap) {
-	case MAC_CAPAB_HCKSUM:
-		result = B_FALSE;
-		break;
-	case MAC_CAPAB_LSO:
-		result = B_FALSE;
-		break;
-	default:
-		result = B_FALSE;
+	if (n == 0) {
+		return (B_FALSE);
 	}
-	return (result);
-}
+	vqp->vq_npushed = 0;
 
+	if (vqp->vq_packed) {
+		vqp->vq_avail_idx += n;
+		return (B_TRUE);
+	}
 
-#define	VIRTIONET_PROP_FEATURES		"_features"
-#define	VIRTIONET_PROP_RECVQSIZE	"_receiveqsize"
-#define	VIRTIONET_PROP_XMITQSIZE	"_transmitqsize"
-#define	VIRTIONET_PROP_CTRLQSIZE	"_controlqsize"
+	virtio_vq_sync_ring(vqp, VQ_AVAIL_RING_OFF(vqp), sizeof (uint16_t),
+	    vqp->vq_avail_idx, n, DDI_DMA_SYNC_FORDEV);
+	vqp->vq_avail_idx += n;
 
+	/* Make sure the ring entries are visible before the index */
+	membar_producer();
+	vqp->vr_avail->idx = vqp->vq_avail_idx;
+	(void) ddi_dma_sync(vqp->vq_dma.hdl, vqp->vq_avail_off,
+	    offsetof(vring_avail_t, ring), DDI_DMA_SYNC_FORDEV);
 
-static int
-virtionet_setprop(void *arg, const char *prop_name, mac_prop_id_t pid,
-	uint_t pvalsize, const void *pval)
+	return (B_TRUE);
+}
+
+
+/* Is the packed ring descriptor at 'pos' used in the 'wrap' lap? */
+static boolean_t
+virtio_vq_packed_used(virtqueue_t *vqp, uint16_t pos, uint16_t wrap)
 {
-	virtionet_state_t	*sp = arg;
+	uint16_t		flags;
+
+	virtio_vq_sync_ring(vqp, 0, sizeof (vring_packed_desc_t), pos, 1,
+	    DDI_DMA_SYNC_FORKERNEL);
+	flags = vqp->vr_pdesc[pos].flags;
 
-	return (ENOTSUP);
+	return (((flags & VRING_PACKED_DESC_F_AVAIL) != 0) == (wrap != 0) &&
+	    ((flags & VRING_PACKED_DESC_F_USED) != 0) == (wrap != 0));
 }
 
-static int
-virtionet_priv_getprop(virtionet_state_t *sp, const char *pname,
-	uint_t pvalsize, void *pval)
+
+/*
+ * Look at the i-th completed chain past the ones already taken, without
+ * taking it. Returns B_FALSE if the device hasn't completed that many.
+ */
+static boolean_t
+virtio_vq_used(virtqueue_t *vqp, uint16_t i, uint16_t *headp, uint32_t *lenp)
 {
-	int			rc = 0;
+	vring_used_elem_t	*uep;
+	vring_packed_desc_t	*pdp;
+	uint16_t		pos;
+	uint16_t		wrap;
+
+	if (vqp->vq_packed) {
+		pos = vqp->vq_used_pos;
+		wrap = vqp->vq_used_wrap;
+		for (;;) {
+			if (!virtio_vq_packed_used(vqp, pos, wrap)) {
+				return (B_FALSE);
+			}
+			/* Read the rest of the descriptor after the flags */
+			membar_consumer();
+			pdp = &vqp->vr_pdesc[pos];
+			if (i-- == 0) {
+				break;
+			}
+			VQ_PACKED_ADVANCE(vqp, pos, wrap,
+			    vqp->vq_chainlen[pdp->id]);
+		}
+		ASSERT(pdp->id < vqp->vq_size);
+		*headp = pdp->id;
+		*lenp = pdp->len;
+		return (B_TRUE);
+	}
 
-	if (strcmp(pname, VIRTIONET_PROP_FEATURES) == 0) {
-		(void) snprintf(pval, pvalsize, "0x%x", sp->features);
-	} else if (strcmp(pname, VIRTIONET_PROP_RECVQSIZE) == 0) {
-		(void) snprintf(pval, pvalsize, "0x%x", sp->rxq->vq_size);
-	} else if (strcmp(pname, VIRTIONET_PROP_XMITQSIZE) == 0) {
-		(void) snprintf(pval, pvalsize, "0x%x", sp->txq->vq_size);
-	} else if (strcmp(pname, VIRTIONET_PROP_CTRLQSIZE) == 0) {
-		(void) snprintf(pval, pvalsize, "0x%x", sp->ctlq->vq_size);
-	} else {
-		rc = ENOTSUP;
+	if ((uint16_t)(vqp->vq_used_idx - vqp->vq_last_used) <= i) {
+		vqp->vq_used_idx = virtio_vq_used_idx(vqp);
+		if ((uint16_t)(vqp->vq_used_idx - vqp->vq_last_used) <= i) {
+			return (B_FALSE);
+		}
+		/* Read the entries after the idx */
+		membar_consumer();
 	}
 
-	return (rc);
+	virtio_vq_sync_ring(vqp, VQ_USED_RING_OFF(vqp),
+	    sizeof (vring_used_elem_t), vqp->vq_last_used + i, 1,
+	    DDI_DMA_SYNC_FORKERNEL);
+	uep = &vqp->vr_used->ring[(uint16_t)(vqp->vq_last_used + i) %
+	    vqp->vq_size];
+	ASSERT(uep->id < vqp->vq_size);
+	*headp = uep->id;
+	*lenp = uep->len;
+	return (B_TRUE);
 }
 
 
-static int
-virtionet_getprop(void *arg, const char *pname, mac_prop_id_t pid,
-	uint_t psize, void *pval)
+/*
+ * Check for completions without taking the queue lock. Only what the
+ * device writes and the consumer position are read, a stale position
+ * gives a false positive at worst.
+ */
+static boolean_t
+virtio_vq_has_used(virtqueue_t *vqp)
 {
-	virtionet_state_t	*sp = arg;
-	int			rc = 0;
-
-	switch (pid) {
-	case MAC_PROP_DUPLEX:
-		ASSERT(psize >= sizeof (link_duplex_t));
-		*(link_duplex_t *)pval = LINK_DUPLEX_FULL;
-		break;
-	case MAC_PROP_SPEED:
-		ASSERT(psize >= sizeof (uint64_t));
-		*(uint64_t *)pval = 1000 * 1000 * 1000;
-		break;
-	case MAC_PROP_STATUS:
-		ASSERT(psize >= sizeof (link_state_t));
-		*(link_state_t *)pval = virtionet_link_status(sp);
-		break;
-	case MAC_PROP_PRIVATE:
-		rc = virtionet_priv_getprop(sp, pname, psize, pval);
-		break;
-	default:
-		rc = ENOTSUP;
+	if (vqp->vq_packed) {
+		return (virtio_vq_packed_used(vqp, vqp->vq_used_pos,
+		    vqp->vq_used_wrap));
 	}
-	return (rc);
+
+	return (virtio_vq_used_idx(vqp) != vqp->vq_last_used);
 }
 
 
-static void
-virtionet_priv_propinfo(virtionet_state_t *sp, const char *pname,
-	mac_prop_info_handle_t ph)
+/*
+ * Take the next completed chain, virtio_vq_used() must have found it.
+ * Returns its head.
+ */
+static uint16_t
+virtio_vq_used_next(virtqueue_t *vqp)
 {
-	mac_prop_info_set_perm(ph, MAC_PROP_PERM_READ);
-	if ((strcmp(pname, VIRTIONET_PROP_FEATURES) == 0) ||
-	    (strcmp(pname, VIRTIONET_PROP_RECVQSIZE) == 0) ||
-	    (strcmp(pname, VIRTIONET_PROP_XMITQSIZE) == 0) ||
-	    (strcmp(pname, VIRTIONET_PROP_CTRLQSIZE) == 0)) {
-		mac_prop_info_set_default_str(ph, "0x0");
+	uint16_t		head;
+
+	if (vqp->vq_packed) {
+		head = vqp->vr_pdesc[vqp->vq_used_pos].id;
+		VQ_PACKED_ADVANCE(vqp, vqp->vq_used_pos, vqp->vq_used_wrap,
+		    vqp->vq_chainlen[head]);
 	} else {
-		cmn_err(CE_NOTE, "Unexpected private property %s",
-		    pname);
+		head = vqp->vr_used->ring[vqp->vq_last_used %
+		    vqp->vq_size].id;
 	}
+	vqp->vq_last_used++;
+
+	return (head);
 }
 
 
+/*
+ * Notify the device of new avail entries unless it doesn't want to hear
+ * about them: with VIRTIO_F_RING_EVENT_IDX only if its avail_event was
+ * passed since the last notification, otherwise unless it has set
+ * VRING_USED_F_NO_NOTIFY. Packed rings have the same in the device
+ * event suppression structure.
+ */
 static void
-virtionet_propinfo(void *arg, const char *pname, mac_prop_id_t pid,
-	mac_prop_info_handle_t ph)
+virtio_vq_kick(virtionet_state_t *sp, virtqueue_t *vqp)
 {
-	virtionet_state_t	*sp = arg;
+	vring_packed_event_t	*evp = vqp->vr_dev_event;
+	uint16_t		new_idx;
+	uint16_t		old_idx;
+	uint16_t		event;
+	boolean_t		kick;
+
+	/* The new avail entries must be visible before the event is read */
+	membar_enter();
+
+	if (vqp->vq_packed) {
+		new_idx = vqp->vq_avail_pos;
+		old_idx = new_idx - vqp->vq_nadded;
+		vqp->vq_nadded = 0;
+		(void) ddi_dma_sync(vqp->vq_dma.hdl, vqp->vq_used_off,
+		    sizeof (vring_packed_event_t), DDI_DMA_SYNC_FORKERNEL);
+		if (evp->flags == VRING_PACKED_EVENT_F_DESC) {
+			event = evp->off_wrap &
+			    ~(1 << VRING_PACKED_EVENT_WRAP_SHIFT);
+			/* An event in the previous lap is a ring behind */
+			if ((evp->off_wrap >> VRING_PACKED_EVENT_WRAP_SHIFT) !=
+			    vqp->vq_avail_wrap) {
+				event -= vqp->vq_size;
+			}
+			kick = VRING_NEED_EVENT(event, new_idx, old_idx);
+		} else {
+			kick = (evp->flags != VRING_PACKED_EVENT_F_DISABLE);
+		}
+	} else {
+		new_idx = vqp->vq_avail_idx;
+		old_idx = vqp->vq_kick_idx;
+		vqp->vq_kick_idx = new_idx;
+		if (vqp->vq_event_idx) {
+			(void) ddi_dma_sync(vqp->vq_dma.hdl,
+			    VQ_USED_RING_OFF(vqp) +
+			    vqp->vq_size * sizeof (vring_used_elem_t),
+			    sizeof (uint16_t), DDI_DMA_SYNC_FORKERNEL);
+			kick = VRING_NEED_EVENT(VRING_AVAIL_EVENT(vqp->vr_used,
+			    vqp->vq_size), new_idx, old_idx);
+		} else {
+			(void) virtio_vq_used_idx(vqp);
+			kick = !(vqp->vr_used->flags & VRING_USED_F_NO_NOTIFY);
+		}
+	}
 
-	switch (pid) {
-	case MAC_PROP_DUPLEX:
-	case MAC_PROP_SPEED:
-	case MAC_PROP_STATUS:
-		mac_prop_info_set_perm(ph, MAC_PROP_PERM_READ);
-		break;
-	case MAC_PROP_PRIVATE:
-		virtionet_priv_propinfo(sp, pname, ph);
-		break;
-	default:
-		/* Do we need to do anything in this case ? */
-		;
+	if (kick) {
+		VIRTIO_VQ_NOTIFY(sp, vqp);
 	}
 }
 
 
-#define	VIRTIONET_CALLBACKS	(MC_IOCTL | MC_GETCAPAB | MC_PROPERTIES)
+/*
+ * Ask for an interrupt once 'n' more used entries, at least one, are
+ * added past the ones already seen. The event index names the entry
+ * whose use triggers the interrupt, the n-th one. Without
+ * VIRTIO_F_RING_EVENT_IDX the device can only be told to interrupt on
+ * every completion.
+ * Returns B_FALSE if the n-th entry was added already, so no interrupt
+ * will come for it and the caller has to process the ring again. Packed
+ * rings count the event in descriptors, so any completion is reported.
+ */
+static boolean_t
+virtio_vq_intr_arm(virtqueue_t *vqp, uint16_t n)
+{
+	uint16_t		head;
+	uint32_t		len;
 
-static mac_callbacks_t virtionet_mac_callbacks = {
-	.mc_callbacks	= VIRTIONET_CALLBACKS,
-	.mc_getstat	= virtionet_getstat,
-	.mc_start	= virtionet_start,
-	.mc_stop	= virtionet_stop,
-	.mc_setpromisc	= virtionet_setpromisc,
-	.mc_multicst	= virtionet_multicst,
-	.mc_unicst	= virtionet_unicst,
-	.mc_tx		= virtionet_tx,
-	.mc_ioctl	= virtionet_ioctl,
-	.mc_getcapab	= virtionet_getcapab,
-	.mc_setprop	= virtionet_setprop,
-	.mc_getprop	= virtionet_getprop,
-	.mc_propinfo	= virtionet_propinfo
-};
+	ASSERT(n > 0);
 
+	if (vqp->vq_packed) {
+		if (vqp->vq_event_idx) {
+			uint16_t	pos = vqp->vq_used_pos;
+			uint16_t	wrap = vqp->vq_used_wrap;
 
-static char *virtionet_priv_props[] = {
-	VIRTIONET_PROP_FEATURES,
-	VIRTIONET_PROP_RECVQSIZE,
-	VIRTIONET_PROP_XMITQSIZE,
-	VIRTIONET_PROP_CTRLQSIZE,
-	NULL
-};
+			VQ_PACKED_ADVANCE(vqp, pos, wrap, n - 1);
+			vqp->vr_drv_event->off_wrap = pos |
+			    (wrap << VRING_PACKED_EVENT_WRAP_SHIFT);
+			vqp->vr_drv_event->flags = VRING_PACKED_EVENT_F_DESC;
+		} else {
+			vqp->vr_drv_event->flags = VRING_PACKED_EVENT_F_ENABLE;
+		}
+		n = 1;
+	} else if (vqp->vq_event_idx) {
+		VRING_USED_EVENT(vqp->vr_avail, vqp->vq_size) =
+		    vqp->vq_last_used + n - 1;
+	} else {
+		vqp->vq_avail_flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+		vqp->vr_avail->flags = vqp->vq_avail_flags;
+		n = 1;
+	}
 
+	/* Publish the request before checking for a completion it missed */
+	membar_enter();
+	virtio_vq_sync_intr(vqp);
 
-/* Register virtionet driver with GLDv3 framework */
-static int
-virtionet_mac_register(virtionet_state_t *sp)
+	return (!virtio_vq_used(vqp, n - 1, &head, &len));
+}
+
+
+/*
+ * Ask the device not to interrupt. The event index is put as far ahead
+ * as a full ring goes, so it has to be pushed again as entries are used.
+ */
+static void
+virtio_vq_intr_disarm(virtqueue_t *vqp)
 {
-	mac_register_t		*mp;
-	int			rc;
+	if (vqp->vq_packed) {
+		vqp->vr_drv_event->flags = VRING_PACKED_EVENT_F_DISABLE;
+	} else if (vqp->vq_event_idx) {
+		VRING_USED_EVENT(vqp->vr_avail, vqp->vq_size) =
+		    vqp->vq_last_used + vqp->vq_size;
+	} else {
+		vqp->vq_avail_flags |= VRING_AVAIL_F_NO_INTERRUPT;
+		vqp->vr_avail->flags = vqp->vq_avail_flags;
+	}
+	virtio_vq_sync_intr(vqp);
+}
 
-	mp = mac_alloc(MAC_VERSION);
-	if (mp == NULL) {
-		return (DDI_FAILURE);
+
+/* Sync 'len' bytes at offset 'off' of a pool buffer */
+static void
+virtionet_buf_sync(virtionet_buf_t *bp, off_t off, size_t len, uint_t flag)
+{
+	(void) ddi_dma_sync(bp->vb_hdl, bp->vb_off + off, len, flag);
+}
+
+
+/*
+ * Update the packet rate estimate of a queue from its packet counter and
+ * decide whether the queue is moderated. When the first queue becomes
+ * moderated '*armp' is set, the caller then starts the timer with
+ * virtionet_imod_arm() once it dropped the ring lock. The timer stops by
+ * itself once no queue is moderated.
+ * Called with the ring lock held whenever the queue is processed.
+ */
+static boolean_t
+virtionet_imod_update(virtionet_state_t *sp, virtionet_imod_t *imp,
+    uint64_t count, boolean_t *armp)
+{
+	hrtime_t		now = gethrtime();
+	hrtime_t		maxint;
+	uint64_t		rate;
+	boolean_t		on;
+
+	if (now - imp->im_ts < VIRTIONET_IMOD_SAMPLE) {
+		return (imp->im_on);
 	}
 
-	mp->m_type_ident	= MAC_PLUGIN_IDENT_ETHER;
-	mp->m_driver		= sp;
-	mp->m_dip		= sp->dip;
-	mp->m_instance		= 0;
-	mp->m_src_addr		= sp->addr;
-	mp->m_dst_addr		= NULL;
-	mp->m_callbacks		= &virtionet_mac_callbacks;
-	mp->m_min_sdu		= 0;
-	mp->m_max_sdu		= ETHERMTU;
-	mp->m_margin		= VLAN_TAGSZ;
-	mp->m_priv_props	= virtionet_priv_props;
+	rate = (count - imp->im_count) * NANOSEC / (now - imp->im_ts);
+	imp->im_rate = (3 * imp->im_rate + rate) / 4;
+	imp->im_count = count;
+	imp->im_ts = now;
+
+	maxint = (hrtime_t)sp->imod_usec * (NANOSEC / MICROSEC);
+	switch (sp->imod_mode) {
+	case VIRTIONET_IMOD_ADAPTIVE:
+		/* Stay moderated until the rate drops well below the limit */
+		on = (imp->im_rate >=
+		    (imp->im_on ? sp->imod_low : sp->imod_high));
+		imp->im_interval = maxint;
+		if (imp->im_rate != 0) {
+			imp->im_interval = MIN(maxint, (hrtime_t)
+			    (virtionet_imod_batch * NANOSEC / imp->im_rate));
+		}
+		imp->im_interval = MAX(imp->im_interval,
+		    VIRTIONET_IMOD_MIN_USEC * (NANOSEC / MICROSEC));
+		break;
+	case VIRTIONET_IMOD_FIXED:
+		on = B_TRUE;
+		imp->im_interval = maxint;
+		break;
+	default:
+		on = B_FALSE;
+	}
 
-	rc = mac_register(mp, &sp->mh);
-	mac_free(mp);
-	if (rc != 0) {
-		return (DDI_FAILURE);
+	if (on != imp->im_on) {
+		mutex_enter(&sp->imod_lock);
+		imp->im_on = on;
+		if (!on) {
+			sp->imod_nqueues--;
+		} else if (sp->imod_nqueues++ == 0) {
+			*armp = B_TRUE;
+		}
+		mutex_exit(&sp->imod_lock);
 	}
 
-	return (DDI_SUCCESS);
+	return (on);
 }
 
 
-/* Unregister virtionet driver from GLDv3 framework */
-static int
-virtionet_mac_unregister(virtionet_state_t *sp)
+/* Run the moderation timer 'interval' from now, unless it was stopped */
+static void
+virtionet_imod_arm(virtionet_state_t *sp, hrtime_t interval)
 {
-	int			rc;
-
-	rc = mac_unregister(sp->mh);
-	if (rc != 0) {
-		return (DDI_FAILURE);
+	mutex_enter(&sp->imod_lock);
+	if ((sp->imod_cyclic != CYCLIC_NONE) && (sp->imod_nqueues != 0)) {
+		(void) cyclic_reprogram(sp->imod_cyclic,
+		    gethrtime() + interval);
 	}
+	mutex_exit(&sp->imod_lock);
+}
 
-	return (DDI_SUCCESS);
+
+/* Unbind the list of DMA handles and return them to the pool */
+static void
+virtionet_tx_unbind(virtionet_txring_t *txr, virtionet_txdmah_t *dmah)
+{
+	virtionet_txdmah_t	*dhp;
+
+	while ((dhp = dmah) != NULL) {
+		dmah = dhp->next;
+		(void) ddi_dma_unbind_handle(dhp->hdl);
+		dhp->next = txr->tr_dmah_free;
+		txr->tr_dmah_free = dhp;
+	}
 }
 
 
 /*
- * Validate that the device in hand is indeed virtio network device
+ * Reclaim the Tx descriptors the device is done with.
+ * Bound packets are unbound and freed in one go after the ring walk.
+ * Returns the number of packets completed.
  */
-static int
-virtio_validate_pcidev(dev_info_t *dip)
+static uint_t
+virtionet_tx_reclaim(virtionet_txring_t *txr)
 {
-	ddi_acc_handle_t	pcihdl;
-	int			rc;
+	virtqueue_t		*vqp = txr->tr_vq;
+	virtionet_txslot_t	*tsp;
+	mblk_t			*mphead = NULL;
+	uint16_t		head;
+	uint32_t		len;
+	uint_t			n = 0;
+
+	ASSERT(MUTEX_HELD(&txr->tr_lock));
+
+	while (virtio_vq_used(vqp, 0, &head, &len)) {
+		tsp = &txr->tr_slots[head];
+		if (tsp->ts_mp != NULL) {
+			virtionet_tx_unbind(txr, tsp->ts_dmah);
+			tsp->ts_dmah = NULL;
+			tsp->ts_mp->b_next = mphead;
+			mphead = tsp->ts_mp;
+			tsp->ts_mp = NULL;
+		}
 
-	rc = pci_config_setup(dip, &pcihdl);
-	if (rc != DDI_SUCCESS) {
-		return (DDI_FAILURE);
+		(void) virtio_vq_used_next(vqp);
+		virtio_vq_free_chain(vqp, head);
+		n++;
 	}
 
-	if (pci_config_get16(pcihdl, PCI_CONF_VENID) != VIRTIO_PCI_VENDOR) {
-		cmn_err(CE_WARN, "Incorrect PCI vendor id");
-		rc = DDI_FAILURE;
+	if (mphead != NULL) {
+		freemsgchain(mphead);
 	}
 
-	uint16_t devid = pci_config_get16(pcihdl, PCI_CONF_DEVID);
+	return (n);
+}
 
-	if ((devid < VIRTIO_PCI_DEVID_MIN) && (devid > VIRTIO_PCI_DEVID_MAX)) {
-		cmn_err(CE_WARN, "Incorrect PCI device id");
-		rc = DDI_FAILURE;
+
+/*
+ * Reclaim completed Tx descriptors and restart the transmit if it was
+ * blocked and enough descriptors are free again.
+ */
+static void
+virtionet_tx_update(virtionet_txring_t *txr)
+{
+	virtqueue_t		*vqp = txr->tr_vq;
+	boolean_t		resched = B_FALSE;
+	boolean_t		arm = B_FALSE;
+	uint_t			thresh;
+	uint16_t		pending;
+
+	mutex_enter(&txr->tr_lock);
+
+	/*
+	 * Completions are only needed to reclaim descriptors, so with event
+	 * indices the next interrupt waits for 3/4 of the pending ones, but
+	 * always for the last of a few. A moderated queue is left to the
+	 * moderation timer instead.
+	 */
+	for (;;) {
+		(void) virtionet_tx_reclaim(txr);
+		if (virtionet_imod_update(txr->tr_sp, &txr->tr_imod,
+		    txr->tr_opackets, &arm)) {
+			virtio_vq_intr_disarm(vqp);
+			break;
+		}
+		pending = VQ_NINFLIGHT(vqp);
+		if (virtio_vq_intr_arm(vqp, MAX(pending - pending / 4, 1))) {
+			break;
+		}
 	}
 
-	if (pci_config_get16(pcihdl, PCI_CONF_REVID) != VIRTIO_PCI_REV_ABIV0) {
-		cmn_err(CE_WARN, "Unsupported virtio ABI detected");
-		rc = DDI_FAILURE;
+	if (txr->tr_blocked) {
+		thresh = MIN(virtionet_tx_resched_thresh, vqp->vq_size / 2);
+		if (vqp->vq_nfree >= thresh) {
+			txr->tr_blocked = B_FALSE;
+			resched = B_TRUE;
+		}
 	}
 
-	pci_config_teardown(&pcihdl);
-	return (rc);
+	mutex_exit(&txr->tr_lock);
+
+	if (arm) {
+		virtionet_imod_arm(txr->tr_sp, txr->tr_imod.im_interval);
+	}
+	if (resched) {
+		mac_tx_ring_update(txr->tr_sp->mh, txr->tr_mrh);
+	}
 }
 
 
 /*
- * Validate that the device in hand is indeed virtio network device
+ * Queue the descriptor chain starting at 'head' for the device. It may
+ * not see it until virtionet_tx_flush() publishes the batch.
  */
-static int
-virtio_validate_netdev(virtionet_state_t *sp)
+static void
+virtionet_tx_publish(virtionet_txring_t *txr, uint16_t head, size_t mlen)
 {
-	cmn_err(CE_CONT, "Device Features 0x%X\n",
-	    VIRTIO_GET32(sp, VIRTIO_DEVICE_FEATURES));
-	cmn_err(CE_CONT, "Guest Features 0x%X\n",
-	    VIRTIO_GET32(sp, VIRTIO_GUEST_FEATURES));
-	cmn_err(CE_CONT, "Device Status 0x%X\n",
-	    VIRTIO_GET8(sp, VIRTIO_DEVICE_STATUS));
-	cmn_err(CE_CONT, "ISR Status 0x%X\n",
-	    VIRTIO_GET8(sp, VIRTIO_ISR_STATUS));
+	virtio_vq_push(txr->tr_vq, head);
 
-	return (DDI_SUCCESS);
+	txr->tr_opackets++;
+	txr->tr_obytes += mlen;
 }
 
 
 /*
- * Negotiate the feature set with the device
- * Return
- *        DDI_SUCCESS if succesfuly negotiated non-zero feature set
- *        DDI_FAILURE otherwise
+ * Make all the queued packets visible to the device at once and notify
+ * it, only once for the whole batch as the notification traps to the
+ * host.
  */
-static int
-virtionet_negotiate_features(virtionet_state_t *sp)
+static void
+virtionet_tx_flush(virtionet_txring_t *txr)
 {
-	sp->features = VIRTIO_GET32(sp, VIRTIO_DEVICE_FEATURES);
-	sp->features &= VIRTIONET_GUEST_FEATURES;
-	if (sp->features != 0) {
-		/* If there any features we support let device know them */
-		VIRTIO_PUT32(sp, VIRTIO_GUEST_FEATURES, sp->features);
-		return (DDI_SUCCESS);
-	} else {
-		/* otherwise report failure to negotiate anything */
-		return (DDI_FAILURE);
+	virtqueue_t		*vqp = txr->tr_vq;
+
+	if (virtio_vq_publish(vqp)) {
+		virtio_vq_kick(txr->tr_sp, vqp);
 	}
 }
 
 
-static void
-virtionet_get_macaddr(virtionet_state_t *sp)
+/*
+ * Copy 'len' bytes at offset 'off' of the message 'mp' into 'buf'.
+ * Returns B_FALSE if the message is too short.
+ */
+static boolean_t
+virtionet_msg_copy(mblk_t *mp, size_t off, size_t len, void *buf)
 {
-	if (sp->features & VIRTIO_NET_F_MAC) {
-		ddi_rep_get8(sp->devhandle, sp->addr,
-		    (uint8_t *)(sp->devaddr + VIRTIO_NET_CFG_MAC),
-		    ETHERADDRL, DDI_DEV_AUTOINCR);
-	} else {
-		/* TODO Should be random, but hardcoded for now */
-		sp->addr[0] = 0;
-		sp->addr[1] = 1;
-		sp->addr[2] = 2;
-		sp->addr[3] = 3;
-		sp->addr[4] = 4;
-		sp->addr[5] = 5;
+	uint8_t			*dst = buf;
+	size_t			n;
+
+	for (; mp != NULL && len > 0; mp = mp->b_cont) {
+		if (off >= MBLKL(mp)) {
+			off -= MBLKL(mp);
+			continue;
+		}
+		n = MIN(MBLKL(mp) - off, len);
+		bcopy(mp->b_rptr + off, dst, n);
+		dst += n;
+		len -= n;
+		off = 0;
 	}
 
-#if defined(DEBUG)
-	cmn_err(CE_NOTE, "Using mac address = %x:%x:%x:%x:%x:%x",
-	    sp->addr[0], sp->addr[1], sp->addr[2],
-	    sp->addr[3], sp->addr[4], sp->addr[5]);
-#endif
+	return (len == 0 ? B_TRUE : B_FALSE);
 }
 
 
-/* Check the status of the virtqueue */
-static void
-virtionet_check_vq(virtionet_state_t *sp, virtqueue_t *vqp)
+/* Length of the Ethernet header, VLAN tag included */
+static size_t
+virtionet_ether_hdrlen(mblk_t *mp)
 {
-	ddi_dma_sync(vqp->vq_dma.hdl, 0, 0, DDI_DMA_SYNC_FORKERNEL);
-	cmn_err(CE_CONT, "Avail [flags=0x%x, idx=%d]\n",
-	    vqp->vr_avail->flags, vqp->vr_avail->idx);
-	cmn_err(CE_CONT, "Used  [flags=0x%x, idx=%d]\n",
-	    vqp->vr_used->flags, vqp->vr_used->idx);
+	uint16_t		etype;
+
+	if (virtionet_msg_copy(mp, offsetof(struct ether_header, ether_type),
+	    sizeof (etype), &etype) != B_TRUE) {
+		return (0);
+	}
+
+	if (ntohs(etype) == ETHERTYPE_VLAN) {
+		return (sizeof (struct ether_vlan_header));
+	}
+	return (sizeof (struct ether_header));
 }
 
 
-static uint_t
-virtionet_intr(caddr_t arg1, caddr_t arg2)
+/*
+ * Length of the IP and TCP headers of the LSO packet following the
+ * Ethernet header and the matching virtio GSO type.
+ * Returns B_FALSE if the headers can't be parsed.
+ */
+static boolean_t
+virtionet_lso_hdrlen(mblk_t *mp, size_t ehlen, size_t *hlenp,
+    uint8_t *gsop)
 {
-	virtionet_state_t	*sp = (virtionet_state_t *)arg1;
-	uint8_t			intr;
+	uint8_t			vhl;
+	uint8_t			thl;
+	size_t			iphlen;
 
-	/* Autoclears the ISR */
-	intr = VIRTIO_ISR(sp);
+	if (virtionet_msg_copy(mp, ehlen, sizeof (vhl), &vhl) != B_TRUE) {
+		return (B_FALSE);
+	}
 
-	cmn_err(CE_NOTE, "intr=0x%X", (int)intr);
+	switch (vhl >> 4) {
+	case 4:
+		iphlen = (vhl & 0x0F) << 2;
+		*gsop = VIRTIO_NET_HDR_GSO_TCPV4;
+		break;
+	case 6:
+		/* The stack doesn't use extension headers for LSO */
+		iphlen = 40;
+		*gsop = VIRTIO_NET_HDR_GSO_TCPV6;
+		break;
+	default:
+		return (B_FALSE);
+	}
 
-	if (intr) {
-		if (intr & VIRTIO_ISR_VQ) {
-			/* VQ update */
-			intr &= (~VIRTIO_ISR_VQ);
-			virtionet_check_vq(sp, sp->rxq);
-			virtionet_check_vq(sp, sp->txq);
-			virtionet_check_vq(sp, sp->ctlq);
-		}
-		if (intr & VIRTIO_ISR_CFG) {
-			/* Configuration update */
-			intr &= (~VIRTIO_ISR_CFG);
-			mac_link_update(sp->mh, virtionet_link_status(sp));
+	/* Data offset field of the TCP header */
+	if (virtionet_msg_copy(mp, ehlen + iphlen + 12, sizeof (thl),
+	    &thl) != B_TRUE) {
+		return (B_FALSE);
+	}
+
+	*hlenp = iphlen + ((thl >> 4) << 2);
+	return (B_TRUE);
+}
+
+
+/*
+ * Fill in the virtio header of an outgoing packet from the offload
+ * information MAC attached to the message.
+ * Returns B_FALSE if the packet asks for an offload that can't be done.
+ */
+static boolean_t
+virtionet_tx_hdr(virtionet_state_t *sp, mblk_t *mp, virtio_net_hdr_t *hdr)
+{
+	uint32_t		start;
+	uint32_t		stuff;
+	uint32_t		flags;
+	uint32_t		mss;
+	size_t			ehlen;
+	size_t			hlen;
+	uint8_t			gso;
+
+	bzero(hdr, sizeof (*hdr));
+
+	if ((sp->features & VIRTIO_NET_F_CSUM) == 0) {
+		return (B_TRUE);
+	}
+
+	ehlen = virtionet_ether_hdrlen(mp);
+
+	mac_hcksum_get(mp, &start, &stuff, NULL, NULL, &flags);
+	if (flags & HCK_PARTIALCKSUM) {
+		/* MAC offsets are relative to the IP header */
+		hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+		hdr->csum_start = ehlen + start;
+		hdr->csum_offset = stuff - start;
+	}
+
+	mac_lso_get(mp, &mss, &flags);
+	if (flags & HW_LSO) {
+		if ((virtionet_lso_hdrlen(mp, ehlen, &hlen, &gso) != B_TRUE) ||
+		    ((gso == VIRTIO_NET_HDR_GSO_TCPV4) &&
+		    (sp->features & VIRTIO_NET_F_HOST_TSO4) == 0) ||
+		    ((gso == VIRTIO_NET_HDR_GSO_TCPV6) &&
+		    (sp->features & VIRTIO_NET_F_HOST_TSO6) == 0)) {
+			return (B_FALSE);
 		}
-		/* Let us know if there is still something interrupting */
-		if (intr) {
-			cmn_err(CE_WARN, "Unknown interrupt 0x%X", intr);
+		hdr->gso_type = gso;
+		hdr->gso_size = mss;
+		hdr->hdr_len = ehlen + hlen;
+	}
+
+	return (B_TRUE);
+}
+
+
+/*
+ * Allocate ring descriptors for a packet made of 'nsegs' buffers, the
+ * virtio header included. With indirect descriptors a packet takes just
+ * one ring descriptor pointing to the indirect table of its slot.
+ * Returns B_FALSE if the ring is full even after reclaiming completions.
+ */
+static boolean_t
+virtionet_tx_alloc(virtionet_txring_t *txr, uint_t nsegs, uint16_t *headp)
+{
+	virtqueue_t		*vqp = txr->tr_vq;
+	uint_t			ndesc;
+
+	ndesc = (txr->tr_ind != NULL) ? 1 : nsegs;
+
+	if (vqp->vq_nfree < ndesc) {
+		/* Let the device work on what is queued before waiting */
+		virtionet_tx_flush(txr);
+		(void) virtionet_tx_reclaim(txr);
+	}
+	if (vqp->vq_nfree < ndesc) {
+		txr->tr_noxmtbuf++;
+		return (B_FALSE);
+	}
+
+	*headp = virtio_vq_alloc_chain(vqp, ndesc);
+	return (B_TRUE);
+}
+
+
+/* Fill in the descriptors of the packet starting at 'head' */
+static void
+virtionet_tx_setdesc(virtionet_txring_t *txr, uint16_t head,
+    const uint64_t *segaddr, const uint32_t *seglen, uint_t nsegs)
+{
+	virtqueue_t		*vqp = txr->tr_vq;
+	virtionet_buf_t		*bp;
+	vring_desc_t		*dp;
+	uint16_t		idx;
+
+	if (txr->tr_ind != NULL) {
+		bp = &txr->tr_ind->vp_bufs[head];
+		dp = (vring_desc_t *)bp->vb_addr;
+		for (uint_t i = 0; i < nsegs; i++) {
+			virtio_vq_set_indirect(vqp, dp, i, nsegs, segaddr[i],
+			    seglen[i], 0);
 		}
-		return (DDI_INTR_CLAIMED);
+		virtionet_buf_sync(bp, 0, nsegs * sizeof (*dp),
+		    DDI_DMA_SYNC_FORDEV);
+
+		vqp->vr_desc[head].addr = bp->vb_paddr;
+		vqp->vr_desc[head].len = nsegs * sizeof (*dp);
+		vqp->vr_desc[head].flags = VRING_DESC_F_INDIRECT;
 	} else {
-		return (DDI_INTR_UNCLAIMED);
+		idx = head;
+		for (uint_t i = 0; i < nsegs; i++) {
+			if (i > 0) {
+				idx = vqp->vr_desc[idx].next;
+			}
+			vqp->vr_desc[idx].addr = segaddr[i];
+			vqp->vr_desc[idx].len = seglen[i];
+		}
 	}
+
+	virtio_vq_sync_chain(vqp, head);
 }
 
 
-/* Device attributes */
-static ddi_device_acc_attr_t virtio_devattr = {
-	.devacc_attr_version		= DDI_DEVICE_ATTR_V0,
-	.devacc_attr_endian_flags	= DDI_STRUCTURE_LE_ACC,
-	.devacc_attr_dataorder		= DDI_STRICTORDER_ACC,
-	.devacc_attr_access		= DDI_DEFAULT_ACC
-};
+/*
+ * Write the packet header into the Tx slot. With MRG_RXBUF or VERSION_1
+ * the header carries num_buffers in both directions, it is unused on Tx.
+ */
+static void
+virtionet_tx_puthdr(virtionet_state_t *sp, caddr_t buf,
+    const virtio_net_hdr_t *vhdr)
+{
+	if (sp->hdrlen == sizeof (virtio_net_hdr_rxbuf_t)) {
+		((virtio_net_hdr_rxbuf_t *)buf)->num_buffers = 0;
+	}
+	*(virtio_net_hdr_t *)buf = *vhdr;
+}
 
 
-/* virtqueue buffer access attributes */
-static ddi_device_acc_attr_t virtio_native_attr = {
-	.devacc_attr_version		= DDI_DEVICE_ATTR_V0,
-	.devacc_attr_endian_flags	= DDI_NEVERSWAP_ACC,
-	.devacc_attr_dataorder		= DDI_STRICTORDER_ACC,
-	.devacc_attr_access		= DDI_DEFAULT_ACC
-};
+/*
+ * Send a packet by copying it into the Tx slot.
+ * Every packet is made of two buffers: the virtio header followed by the
+ * frame itself. Both live in the Tx slot that belongs to the head
+ * descriptor, so the slot can't be reused until the chain is reclaimed.
+ */
+static boolean_t
+virtionet_send_copy(virtionet_txring_t *txr, mblk_t *mp, size_t mlen,
+    const virtio_net_hdr_t *vhdr)
+{
+	virtionet_state_t	*sp = txr->tr_sp;
+	virtionet_buf_t		*bp;
+	uint64_t		segaddr[2];
+	uint32_t		seglen[2];
+	uint16_t		head;
 
+	ASSERT(mlen <= VIRTIONET_BUFSZ - sp->hdrlen);
 
-static ddi_dma_attr_t vq_dma_attr = {
-	.dma_attr_version		= DMA_ATTR_V0,
-	.dma_attr_addr_lo		= 0,
-	.dma_attr_addr_hi		= 0xFFFFFFFFU,
-	.dma_attr_count_max		= 0xFFFFFFFFU,
-	.dma_attr_align			= 4096,
-	.dma_attr_burstsizes		= 1,
-	.dma_attr_minxfer		= 1,
-	.dma_attr_maxxfer		= 0xFFFFFFFFU,
-	.dma_attr_seg			= 0xFFFFFFFFU,
-	.dma_attr_sgllen		= 1,
-	.dma_attr_granular		= 1,
-	.dma_attr_flags			= DDI_DMA_FORCE_PHYSICAL
-};
+	if (virtionet_tx_alloc(txr, 2, &head) != B_TRUE) {
+		/* Ring is full, let the caller give the packet back to MAC */
+		return (B_FALSE);
+	}
 
+	bp = &txr->tr_buf->vp_bufs[head];
 
-static virtqueue_t *
-virtio_vq_setup(virtionet_state_t *sp, int queue)
+	virtionet_tx_puthdr(sp, bp->vb_addr, vhdr);
+	mcopymsg(mp, bp->vb_addr + sp->hdrlen);
+
+	virtionet_buf_sync(bp, 0, sp->hdrlen + mlen, DDI_DMA_SYNC_FORDEV);
+
+	segaddr[0] = bp->vb_paddr;
+	seglen[0] = sp->hdrlen;
+	segaddr[1] = segaddr[0] + sp->hdrlen;
+	seglen[1] = mlen;
+	virtionet_tx_setdesc(txr, head, segaddr, seglen, 2);
+
+	virtionet_tx_publish(txr, head, mlen);
+
+	return (B_TRUE);
+}
+
+
+/*
+ * Send a packet by binding its fragments for DMA, the mblk is freed when
+ * the descriptors are reclaimed. The virtio header still comes from the
+ * Tx slot of the head descriptor.
+ * Returns
+ *        0 if the packet was sent
+ *        ENOSPC if there are not enough descriptors or DMA handles
+ *        EFAULT if the packet can't be bound, the caller should copy it
+ */
+static int
+virtionet_send_bind(virtionet_txring_t *txr, mblk_t *mp, size_t mlen,
+    const virtio_net_hdr_t *vhdr)
 {
-	virtqueue_t		*vqp = NULL;
-	size_t			len;
-	size_t			desc_size;
-	size_t			avail_size;
-	size_t			used_size;
-	size_t			part1;
-	size_t			part2;
+	virtionet_state_t	*sp = txr->tr_sp;
+	virtionet_txdmah_t	*dmah = NULL;
+	virtionet_txdmah_t	*dhp;
+	virtionet_txslot_t	*tsp;
+	ddi_dma_cookie_t	cookie;
+	uint64_t		segaddr[VIRTIONET_TX_MAXSEGS + 1];
+	uint32_t		seglen[VIRTIONET_TX_MAXSEGS + 1];
+	uint_t			nsegs = 1;	/* the header */
+	uint_t			ccount;
+	virtionet_buf_t		*hdrbuf;
+	uint16_t		head;
+	mblk_t			*bp;
 	int			rc;
 
-	vqp = kmem_zalloc(sizeof (*vqp), KM_SLEEP);
+	for (bp = mp; bp != NULL; bp = bp->b_cont) {
+		if (MBLKL(bp) == 0) {
+			continue;
+		}
 
-	/* save the queue number */
-	vqp->vq_num = queue;
+		dhp = txr->tr_dmah_free;
+		if (dhp == NULL) {
+			/* Completed packets give their handles back */
+			virtionet_tx_flush(txr);
+			(void) virtionet_tx_reclaim(txr);
+			dhp = txr->tr_dmah_free;
+		}
+		if (dhp == NULL) {
+			txr->tr_noxmtbuf++;
+			virtionet_tx_unbind(txr, dmah);
+			return (ENOSPC);
+		}
 
-	/* Get the queue size */
-	VIRTIO_PUT16(sp, VIRTIO_QUEUE_SELECT, queue);
-	vqp->vq_size = VIRTIO_GET16(sp, VIRTIO_QUEUE_SIZE);
+		rc = ddi_dma_addr_bind_handle(dhp->hdl, NULL,
+		    (caddr_t)bp->b_rptr, MBLKL(bp),
+		    DDI_DMA_WRITE | DDI_DMA_STREAMING, DDI_DMA_DONTWAIT, NULL,
+		    &cookie, &ccount);
+		if (rc != DDI_DMA_MAPPED) {
+			goto fail;
+		}
 
-	desc_size = VRING_DTABLE_SIZE(vqp->vq_size);
-	avail_size = VRING_AVAIL_SIZE(vqp->vq_size);
-	used_size = VRING_USED_SIZE(vqp->vq_size);
+		txr->tr_dmah_free = dhp->next;
+		dhp->next = dmah;
+		dmah = dhp;
 
-	part1 = VRING_ROUNDUP(desc_size + avail_size);
-	part2 = VRING_ROUNDUP(used_size);
+		if (nsegs + ccount > VIRTIONET_TX_MAXSEGS + 1) {
+			goto fail;
+		}
 
-	len = part1 + part2;
+		(void) ddi_dma_sync(dhp->hdl, 0, 0, DDI_DMA_SYNC_FORDEV);
 
-	vq_dma_attr.dma_attr_flags |= DDI_DMA_FORCE_PHYSICAL;
+		for (;;) {
+			segaddr[nsegs] = cookie.dmac_laddress;
+			seglen[nsegs] = cookie.dmac_size;
+			nsegs++;
+			if (--ccount == 0) {
+				break;
+			}
+			ddi_dma_nextcookie(dhp->hdl, &cookie);
+		}
+	}
 
-	rc = ddi_dma_alloc_handle(sp->dip, &vq_dma_attr, DDI_DMA_SLEEP,
-	    NULL, &vqp->vq_dma.hdl);
+	if (virtionet_tx_alloc(txr, nsegs, &head) != B_TRUE) {
+		virtionet_tx_unbind(txr, dmah);
+		return (ENOSPC);
+	}
 
-	if (rc == DDI_DMA_BADATTR) {
-		cmn_err(CE_NOTE, "Failed to allocate physical DMA; "
-		    "failing back to virtual DMA");
-		vq_dma_attr.dma_attr_flags &= (~DDI_DMA_FORCE_PHYSICAL);
-		rc = ddi_dma_alloc_handle(sp->dip, &vq_dma_attr, DDI_DMA_SLEEP,
-		    NULL, &vqp->vq_dma.hdl);
+	hdrbuf = &txr->tr_buf->vp_bufs[head];
+
+	virtionet_tx_puthdr(sp, hdrbuf->vb_addr, vhdr);
+	virtionet_buf_sync(hdrbuf, 0, sp->hdrlen, DDI_DMA_SYNC_FORDEV);
+
+	segaddr[0] = hdrbuf->vb_paddr;
+	seglen[0] = sp->hdrlen;
+	virtionet_tx_setdesc(txr, head, segaddr, seglen, nsegs);
+
+	tsp = &txr->tr_slots[head];
+	ASSERT(tsp->ts_mp == NULL);
+	tsp->ts_mp = mp;
+	tsp->ts_dmah = dmah;
+
+	virtionet_tx_publish(txr, head, mlen);
+
+	return (0);
+
+fail:
+	virtionet_tx_unbind(txr, dmah);
+	return (EFAULT);
+}
+
+
+/*
+ * Enqueue a single packet 'mp' for sending.
+ * Small packets are copied, larger ones are bound for DMA directly and
+ * fall back to the copy if binding is not possible. Packets too large to
+ * copy (LSO) are pulled up into a single fragment and bound again.
+ */
+static boolean_t
+virtionet_send(virtionet_txring_t *txr, mblk_t *mp)
+{
+	virtionet_state_t	*sp = txr->tr_sp;
+	virtio_net_hdr_t	hdr;
+	mblk_t			*nmp;
+	size_t			mlen;
+	int			rc;
+
+	ASSERT(mp != NULL);
+
+	/* Offload info has to be taken from the original message */
+	if (virtionet_tx_hdr(sp, mp, &hdr) != B_TRUE) {
+		txr->tr_oerrors++;
+		freemsg(mp);
+		return (B_TRUE);
 	}
 
-	if (rc != DDI_SUCCESS) {
-		kmem_free(vqp, sizeof (*vqp));
-		return (NULL);
+	mlen = msgsize(mp);
+
+	if (mlen > virtionet_tx_copybreak) {
+		switch (virtionet_send_bind(txr, mp, mlen, &hdr)) {
+		case 0:
+			return (B_TRUE);
+		case ENOSPC:
+			return (B_FALSE);
+		default:
+			break;
+		}
 	}
 
-	rc = ddi_dma_mem_alloc(vqp->vq_dma.hdl, len, &virtio_native_attr,
-	    DDI_DMA_CONSISTENT, DDI_DMA_SLEEP, NULL, &vqp->vq_dma.addr,
-	    &vqp->vq_dma.len, &vqp->vq_dma.acchdl);
-	if (rc != DDI_SUCCESS) {
-		ddi_dma_free_handle(&vqp->vq_dma.hdl);
-		kmem_free(vqp, sizeof (*vqp));
-		return (NULL);
+	if (mlen > VIRTIONET_BUFSZ - sp->hdrlen) {
+		nmp = msgpullup(mp, -1);
+		if (nmp == NULL) {
+			txr->tr_noxmtbuf++;
+			freemsg(mp);
+			return (B_TRUE);
+		}
+		rc = virtionet_send_bind(txr, nmp, mlen, &hdr);
+		if (rc == 0) {
+			freemsg(mp);
+			return (B_TRUE);
+		}
+		freemsg(nmp);
+		if (rc == ENOSPC) {
+			return (B_FALSE);
+		}
+		txr->tr_oerrors++;
+		freemsg(mp);
+		return (B_TRUE);
 	}
 
-	bzero(vqp->vq_dma.addr, vqp->vq_dma.len);
+	return (virtionet_send_copy(txr, mp, mlen, &hdr));
+}
 
-	rc = ddi_dma_addr_bind_handle(vqp->vq_dma.hdl, NULL, vqp->vq_dma.addr,
-	    vqp->vq_dma.len, DDI_DMA_RDWR | DDI_DMA_CONSISTENT, DDI_DMA_SLEEP,
-	    NULL, &vqp->vq_dma.cookie, &vqp->vq_dma.ccount);
-	if (rc != DDI_DMA_MAPPED) {
-		ddi_dma_mem_free(&vqp->vq_dma.acchdl);
-		ddi_dma_free_handle(&vqp->vq_dma.hdl);
-		kmem_free(vqp, sizeof (*vqp));
-		return (NULL);
+
+/*
+ * Take a completed command off the control queue and free its chain and
+ * buffer, whichever command it was. Returns the head of the chain.
+ */
+static uint16_t
+virtionet_ctrl_reclaim(virtionet_state_t *sp)
+{
+	virtqueue_t		*vqp = sp->ctlq;
+	uint16_t		head;
+
+	head = virtio_vq_used_next(vqp);
+	virtio_vq_free_chain(vqp, head);
+	for (uint_t i = 0; i < VIRTIONET_CTRL_NBUFS; i++) {
+		if (sp->ctl_heads[i] == head) {
+			sp->ctl_heads[i] = VIRTIONET_CTRL_FREE;
+			break;
+		}
+	}
+
+	return (head);
+}
+
+/*
+ * Send a command over the control queue and wait for the device to
+ * acknowledge it. The command header, its data and the ack byte live in
+ * one control buffer, the first one not held by a command that timed out.
+ * Late completions of those are reclaimed on the way.
+ * Returns DDI_SUCCESS if the device acknowledged with VIRTIO_NET_OK.
+ */
+static int
+virtionet_ctrl_cmd(virtionet_state_t *sp, uint8_t class, uint8_t cmd,
+    const void *data, size_t len)
+{
+	virtqueue_t		*vqp = sp->ctlq;
+	virtionet_buf_t		*bp;
+	uint8_t			*buf;
+	uint64_t		addr;
+	uint16_t		head;
+	uint16_t		idx;
+	uint16_t		uhead;
+	uint32_t		ulen;
+	uint_t			slot;
+	hrtime_t		deadline;
+
+	ASSERT(MUTEX_HELD(&sp->ctl_lock));
+	ASSERT(len > 0);
+	ASSERT(len <= VIRTIONET_CTRL_BUFSZ - sizeof (virtio_net_ctrl_hdr_t) -
+	    sizeof (uint8_t));
+
+	if (vqp == NULL) {
+		return (DDI_FAILURE);
+	}
+
+	/* Commands that timed out may have completed since */
+	while (virtio_vq_used(vqp, 0, &uhead, &ulen)) {
+		(void) virtionet_ctrl_reclaim(sp);
+	}
+
+	for (slot = 0; slot < VIRTIONET_CTRL_NBUFS; slot++) {
+		if (sp->ctl_heads[slot] == VIRTIONET_CTRL_FREE) {
+			break;
+		}
+	}
+	if ((slot == VIRTIONET_CTRL_NBUFS) || (vqp->vq_nfree < 3)) {
+		return (DDI_FAILURE);
+	}
+
+	bp = &sp->ctlbuf->vp_bufs[slot];
+	buf = (uint8_t *)bp->vb_addr;
+	addr = bp->vb_paddr;
+
+	head = virtio_vq_alloc_chain(vqp, 3);
+	sp->ctl_heads[slot] = head;
+
+	((virtio_net_ctrl_hdr_t *)buf)->class = class;
+	((virtio_net_ctrl_hdr_t *)buf)->cmd = cmd;
+	bcopy(data, buf + sizeof (virtio_net_ctrl_hdr_t), len);
+	buf[VIRTIONET_CTRL_BUFSZ - 1] = VIRTIO_NET_ERR;
+	virtionet_buf_sync(bp, 0, VIRTIONET_CTRL_BUFSZ, DDI_DMA_SYNC_FORDEV);
+
+	idx = head;
+	vqp->vr_desc[idx].addr = addr;
+	vqp->vr_desc[idx].len = sizeof (virtio_net_ctrl_hdr_t);
+	idx = vqp->vr_desc[idx].next;
+	vqp->vr_desc[idx].addr = addr + sizeof (virtio_net_ctrl_hdr_t);
+	vqp->vr_desc[idx].len = len;
+	idx = vqp->vr_desc[idx].next;
+	vqp->vr_desc[idx].addr = addr + VIRTIONET_CTRL_BUFSZ - 1;
+	vqp->vr_desc[idx].len = sizeof (uint8_t);
+	vqp->vr_desc[idx].flags |= VRING_DESC_F_WRITE;
+	virtio_vq_sync_chain(vqp, head);
+
+	virtio_vq_push(vqp, head);
+	(void) virtio_vq_publish(vqp);
+	virtio_vq_kick(sp, vqp);
+
+	/* No interrupt for the control queue, sleep between polls */
+	deadline = gethrtime() + VIRTIONET_CTRL_TIMEOUT * (NANOSEC / MILLISEC);
+	for (;;) {
+		while (virtio_vq_used(vqp, 0, &uhead, &ulen)) {
+			if (virtionet_ctrl_reclaim(sp) == head) {
+				break;
+			}
+		}
+		if (sp->ctl_heads[slot] == VIRTIONET_CTRL_FREE) {
+			break;
+		}
+		if (gethrtime() >= deadline) {
+			/*
+			 * Orphaned: the chain and its buffer stay reserved
+			 * in ctl_heads[] until the device gives them back.
+			 */
+			return (DDI_FAILURE);
+		}
+		delay(drv_usectohz(1000));
 	}
-	ASSERT(vqp->vq_dma.ccount == 1);
 
-	vqp->vr_desc = (vring_desc_t *)vqp->vq_dma.addr;
-	vqp->vr_avail = (vring_avail_t *)(vqp->vq_dma.addr + desc_size);
-	vqp->vr_used = (vring_used_t *)(vqp->vq_dma.addr + part1);
+	virtionet_buf_sync(bp, VIRTIONET_CTRL_BUFSZ - 1, sizeof (uint8_t),
+	    DDI_DMA_SYNC_FORKERNEL);
+
+	return ((buf[VIRTIONET_CTRL_BUFSZ - 1] == VIRTIO_NET_OK) ?
+	    DDI_SUCCESS : DDI_FAILURE);
+}
+
+
+/*
+ * MAC ring callbacks
+ */
+static int
+virtionet_rx_ring_start(mac_ring_driver_t rh, uint64_t gen)
+{
+	virtionet_rxring_t	*rxr = (virtionet_rxring_t *)rh;
+
+	mutex_enter(&rxr->rr_lock);
+	rxr->rr_gen = gen;
+	mutex_exit(&rxr->rr_lock);
+
+	return (0);
+}
+
+
+/*
+ * Rx ring polling. MAC turns the ring interrupt off while its soft ring
+ * worker pulls frames with mri_poll, and back on once the burst is over.
+ */
+static mblk_t *
+virtionet_rx_ring_poll(void *arg, int bytes)
+{
+	virtionet_rxring_t	*rxr = arg;
+	mblk_t			*mp;
+
+	ASSERT(bytes > 0);
+
+	mutex_enter(&rxr->rr_lock);
+	mp = virtionet_rx(rxr, bytes);
+	virtio_vq_intr_disarm(rxr->rr_vq);
+	mutex_exit(&rxr->rr_lock);
+
+	return (mp);
+}
+
+
+static int
+virtionet_rx_ring_intr_disable(mac_intr_handle_t ih)
+{
+	virtionet_rxring_t	*rxr = (virtionet_rxring_t *)ih;
+
+	mutex_enter(&rxr->rr_lock);
+	rxr->rr_polling = B_TRUE;
+	virtio_vq_intr_disarm(rxr->rr_vq);
+	mutex_exit(&rxr->rr_lock);
+
+	return (0);
+}
+
+
+/*
+ * The device doesn't interrupt for frames completed while the flag was
+ * set, so check for them once it is cleared. They are delivered from a
+ * soft interrupt as MAC holds locks mac_rx_ring() needs here.
+ */
+static int
+virtionet_rx_ring_intr_enable(mac_intr_handle_t ih)
+{
+	virtionet_rxring_t	*rxr = (virtionet_rxring_t *)ih;
+	boolean_t		missed;
+
+	mutex_enter(&rxr->rr_lock);
+	rxr->rr_polling = B_FALSE;
+	missed = !virtio_vq_intr_arm(rxr->rr_vq, 1);
+	mutex_exit(&rxr->rr_lock);
+
+	if (missed) {
+		(void) ddi_intr_trigger_softint(rxr->rr_softint, NULL);
+	}
+
+	return (0);
+}
+
+
+static int
+virtionet_rx_ring_stat(mac_ring_driver_t rh, uint_t stat, uint64_t *val)
+{
+	virtionet_rxring_t	*rxr = (virtionet_rxring_t *)rh;
+	int			rc = 0;
+
+	switch (stat) {
+	case MAC_STAT_NORCVBUF:
+		*val = rxr->rr_norcvbuf;
+		break;
+	case MAC_STAT_IERRORS:
+		*val = rxr->rr_ierrors;
+		break;
+	case MAC_STAT_RBYTES:
+		*val = rxr->rr_rbytes;
+		break;
+	case MAC_STAT_IPACKETS:
+		*val = rxr->rr_ipackets;
+		break;
+	default:
+		rc = ENOTSUP;
+	}
+	return (rc);
+}
+
+
+static int
+virtionet_tx_ring_stat(mac_ring_driver_t rh, uint_t stat, uint64_t *val)
+{
+	virtionet_txring_t	*txr = (virtionet_txring_t *)rh;
+	int			rc = 0;
+
+	switch (stat) {
+	case MAC_STAT_NOXMTBUF:
+		*val = txr->tr_noxmtbuf;
+		break;
+	case MAC_STAT_OERRORS:
+		*val = txr->tr_oerrors;
+		break;
+	case MAC_STAT_OBYTES:
+		*val = txr->tr_obytes;
+		break;
+	case MAC_STAT_OPACKETS:
+		*val = txr->tr_opackets;
+		break;
+	default:
+		rc = ENOTSUP;
+	}
+	return (rc);
+}
+
+
+/* Sum a per ring statistic over all the rings of the type */
+static uint64_t
+virtionet_ring_stat_sum(virtionet_state_t *sp, mac_ring_type_t rtype,
+    uint_t stat)
+{
+	uint64_t		sum = 0;
+	uint64_t		val;
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		if (rtype == MAC_RING_TYPE_RX) {
+			(void) virtionet_rx_ring_stat(
+			    (mac_ring_driver_t)&sp->rxrings[i], stat, &val);
+		} else {
+			(void) virtionet_tx_ring_stat(
+			    (mac_ring_driver_t)&sp->txrings[i], stat, &val);
+		}
+		sum += val;
+	}
+
+	return (sum);
+}
+
+
+static mblk_t *
+virtionet_ring_tx(void *arg, mblk_t *mp)
+{
+	virtionet_txring_t	*txr = arg;
+	mblk_t			*next;
+
+	mutex_enter(&txr->tr_lock);
+	while (mp != NULL) {
+		next = mp->b_next;
+		mp->b_next = NULL;
+		if (virtionet_send(txr, mp) != B_TRUE) {
+			/* Out of descriptors, wait for mac_tx_ring_update() */
+			mp->b_next = next;
+			txr->tr_blocked = B_TRUE;
+			break;
+		}
+		mp = next;
+	}
+	virtionet_tx_flush(txr);
+	mutex_exit(&txr->tr_lock);
+
+	return (mp);
+}
+
+
+/*
+ * The device has no unicast filter to program, it delivers whatever is
+ * sent to its own address. The group takes that one address only.
+ */
+static int
+virtionet_addmac(void *arg, const uint8_t *mac_addr)
+{
+	virtionet_state_t	*sp = arg;
+	int			rc = 0;
+
+	mutex_enter(&sp->lock);
+	if (sp->unicst_set) {
+		rc = ENOSPC;
+	} else {
+		sp->unicst_set = B_TRUE;
+	}
+	mutex_exit(&sp->lock);
+
+	return (rc);
+}
+
+
+static int
+virtionet_remmac(void *arg, const uint8_t *mac_addr)
+{
+	virtionet_state_t	*sp = arg;
+
+	mutex_enter(&sp->lock);
+	sp->unicst_set = B_FALSE;
+	mutex_exit(&sp->lock);
+
+	return (0);
+}
+
+
+static void
+virtionet_fill_ring(void *arg, mac_ring_type_t rtype, const int gindex,
+    const int rindex, mac_ring_info_t *infop, mac_ring_handle_t rh)
+{
+	virtionet_state_t	*sp = arg;
+	int			vec;
+
+	switch (rtype) {
+	case MAC_RING_TYPE_RX: {
+		virtionet_rxring_t	*rxr = &sp->rxrings[rindex];
+
+		rxr->rr_mrh = rh;
+		infop->mri_driver = (mac_ring_driver_t)rxr;
+		infop->mri_start = virtionet_rx_ring_start;
+		infop->mri_stop = NULL;
+		infop->mri_poll = virtionet_rx_ring_poll;
+		infop->mri_stat = virtionet_rx_ring_stat;
+		infop->mri_intr.mi_handle = (mac_intr_handle_t)rxr;
+		infop->mri_intr.mi_enable = virtionet_rx_ring_intr_enable;
+		infop->mri_intr.mi_disable = virtionet_rx_ring_intr_disable;
+		vec = VIRTIONET_MSIX_RX(rindex);
+		break;
+	}
+	case MAC_RING_TYPE_TX: {
+		virtionet_txring_t	*txr = &sp->txrings[rindex];
+
+		txr->tr_mrh = rh;
+		infop->mri_driver = (mac_ring_driver_t)txr;
+		infop->mri_start = NULL;
+		infop->mri_stop = NULL;
+		infop->mri_tx = virtionet_ring_tx;
+		infop->mri_stat = virtionet_tx_ring_stat;
+		infop->mri_intr.mi_handle = (mac_intr_handle_t)txr;
+		infop->mri_intr.mi_enable = NULL;
+		infop->mri_intr.mi_disable = NULL;
+		vec = VIRTIONET_MSIX_TX(rindex);
+		break;
+	}
+	default:
+		return;
+	}
+
+	/* Lets MAC bind the ring's vector to the CPU handling it */
+	if (sp->intr_type == DDI_INTR_TYPE_MSIX) {
+		infop->mri_intr.mi_ddi_handle = sp->ihandles[vec];
+	}
+}
+
+
+static void
+virtionet_fill_group(void *arg, mac_ring_type_t rtype, const int index,
+    mac_group_info_t *infop, mac_group_handle_t gh)
+{
+	virtionet_state_t	*sp = arg;
+
+	ASSERT(rtype == MAC_RING_TYPE_RX);
+
+	infop->mgi_driver = (mac_group_driver_t)sp;
+	infop->mgi_start = NULL;
+	infop->mgi_stop = NULL;
+	infop->mgi_addmac = virtionet_addmac;
+	infop->mgi_remmac = virtionet_remmac;
+	infop->mgi_count = sp->nqpairs;
+}
+
+
+/*
+ * MAC callbacks
+ */
+static int
+virtionet_getstat(void *arg, uint_t stat, uint64_t *val)
+{
+	virtionet_state_t	*sp = arg;
+	int			rc = 0;
+
+	switch (stat) {
+	case MAC_STAT_IFSPEED:
+		*val = 1000 * 1000 * 1000;
+		break;
+	case MAC_STAT_NORCVBUF:
+	case MAC_STAT_IERRORS:
+	case MAC_STAT_RBYTES:
+	case MAC_STAT_IPACKETS:
+		*val = virtionet_ring_stat_sum(sp, MAC_RING_TYPE_RX, stat);
+		break;
+	case MAC_STAT_NOXMTBUF:
+	case MAC_STAT_OERRORS:
+	case MAC_STAT_OBYTES:
+	case MAC_STAT_OPACKETS:
+		*val = virtionet_ring_stat_sum(sp, MAC_RING_TYPE_TX, stat);
+		break;
+	case MAC_STAT_MULTIRCV:
+	case MAC_STAT_BRDCSTRCV:
+	case MAC_STAT_MULTIXMT:
+	case MAC_STAT_BRDCSTXMT:
+	case MAC_STAT_UNKNOWNS:
+	case MAC_STAT_COLLISIONS:
+	case MAC_STAT_UNDERFLOWS:
+	case MAC_STAT_OVERFLOWS:
+	case ETHER_STAT_ALIGN_ERRORS:
+	case ETHER_STAT_FCS_ERRORS:
+	case ETHER_STAT_FIRST_COLLISIONS:
+	case ETHER_STAT_MULTI_COLLISIONS:
+	case ETHER_STAT_SQE_ERRORS:
+	case ETHER_STAT_DEFER_XMTS:
+	case ETHER_STAT_TX_LATE_COLLISIONS:
+	case ETHER_STAT_EX_COLLISIONS:
+	case ETHER_STAT_MACXMT_ERRORS:
+	case ETHER_STAT_CARRIER_ERRORS:
+	case ETHER_STAT_TOOLONG_ERRORS:
+	case ETHER_STAT_MACRCV_ERRORS:
+	case ETHER_STAT_XCVR_ADDR:
+	case ETHER_STAT_XCVR_ID:
+	case ETHER_STAT_XCVR_INUSE:
+	case ETHER_STAT_CAP_1000FDX:
+	case ETHER_STAT_CAP_1000HDX:
+	case ETHER_STAT_CAP_100FDX:
+	case ETHER_STAT_CAP_100HDX:
+	case ETHER_STAT_CAP_10FDX:
+	case ETHER_STAT_CAP_10HDX:
+	case ETHER_STAT_CAP_ASMPAUSE:
+	case ETHER_STAT_CAP_PAUSE:
+	case ETHER_STAT_CAP_AUTONEG:
+	case ETHER_STAT_ADV_CAP_1000FDX:
+	case ETHER_STAT_ADV_CAP_1000HDX:
+	case ETHER_STAT_ADV_CAP_100FDX:
+	case ETHER_STAT_ADV_CAP_100HDX:
+	case ETHER_STAT_ADV_CAP_10FDX:
+	case ETHER_STAT_ADV_CAP_10HDX:
+	case ETHER_STAT_ADV_CAP_ASMPAUSE:
+	case ETHER_STAT_ADV_CAP_PAUSE:
+	case ETHER_STAT_ADV_CAP_AUTONEG:
+	case ETHER_STAT_LP_CAP_1000FDX:
+	case ETHER_STAT_LP_CAP_1000HDX:
+	case ETHER_STAT_LP_CAP_100FDX:
+	case ETHER_STAT_LP_CAP_100HDX:
+	case ETHER_STAT_LP_CAP_10FDX:
+	case ETHER_STAT_LP_CAP_10HDX:
+	case ETHER_STAT_LP_CAP_ASMPAUSE:
+	case ETHER_STAT_LP_CAP_PAUSE:
+	case ETHER_STAT_LP_CAP_AUTONEG:
+	case ETHER_STAT_LINK_ASMPAUSE:
+	case ETHER_STAT_LINK_PAUSE:
+	case ETHER_STAT_LINK_AUTONEG:
+		rc = ENOTSUP;
+		break;
+	case ETHER_STAT_LINK_DUPLEX:
+		*val = LINK_DUPLEX_FULL;
+		break;
+	default:
+		rc = ENOTSUP;
+	}
+	return (rc);
+}
+
+
+static int
+virtionet_start(void *arg)
+{
+	virtionet_state_t	*sp = arg;
+
+	cmn_err(CE_CONT, "virtionet_start\n");
+
+	mutex_enter(&sp->lock);
+
+	/* A failed MTU change may have left the device without queues */
+	if (sp->rxrings[0].rr_vq == NULL) {
+		mutex_exit(&sp->lock);
+		return (EIO);
+	}
+
+	VIRTIO_DEV_DRIVER_OK(sp);
+	sp->started = B_TRUE;
+	mutex_exit(&sp->lock);
+
+	/*
+	 * The device only uses the first queue pair until told otherwise.
+	 * The queues can't be reset while started, so the command is sent
+	 * without sp->lock, it may sleep waiting for the device.
+	 */
+	if (sp->nqpairs > 1) {
+		uint16_t	npairs = sp->nqpairs;
+
+		mutex_enter(&sp->ctl_lock);
+		if (virtionet_ctrl_cmd(sp, VIRTIO_NET_CTRL_MQ,
+		    VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET, &npairs,
+		    sizeof (npairs)) != DDI_SUCCESS) {
+			cmn_err(CE_WARN, "Failed to enable %u queue pairs",
+			    sp->nqpairs);
+		}
+		mutex_exit(&sp->ctl_lock);
+	}
+
+	mac_link_update(sp->mh, virtionet_link_status(sp));
+
+	return (0);
+}
+
+static void
+virtionet_stop(void *arg)
+{
+	virtionet_state_t	*sp = arg;
+
+	cmn_err(CE_CONT, "virtionet_stop\n");
+
+	mutex_enter(&sp->lock);
+	sp->started = B_FALSE;
+	mutex_exit(&sp->lock);
+}
+
+static int
+virtionet_setpromisc(void *arg, boolean_t promisc_mode)
+{
+	virtionet_state_t	*sp = arg;
+
+	cmn_err(CE_CONT, "virtionet_setpromisc\n");
+
+	return (0);
+}
+
+static int
+virtionet_multicst(void *arg, boolean_t add, const uint8_t *mcast_addr)
+{
+	virtionet_state_t	*sp = arg;
+
+	cmn_err(CE_CONT, "virtionet_multicst\n");
+
+	return (0);
+}
+
+static void
+virtionet_ioctl(void *arg, queue_t *q, mblk_t *mp)
+{
+	virtionet_state_t	*sp = arg;
+
+	cmn_err(CE_CONT, "virtionet_ioctl\n");
+}
+
+static boolean_t
+virtionet_getcapab(void *arg, mac_capab_t cap, void *cap_data)
+{
+	virtionet_state_t	*sp = arg;
+	boolean_t		result;
+
+	switch (cap) {
+	case MAC_CAPAB_HCKSUM:
+		if (sp->features & VIRTIO_NET_F_CSUM) {
+			/* Device fills the checksum from csum_start */
+			*(uint32_t *)cap_data = HCKSUM_INET_PARTIAL;
+			result = B_TRUE;
+		} else {
+			result = B_FALSE;
+		}
+		break;
+	case MAC_CAPAB_LSO: {
+		mac_capab_lso_t	*lso = cap_data;
+
+		/* Segmentation relies on the checksum offload */
+		if ((sp->features & VIRTIO_NET_F_CSUM) == 0) {
+			result = B_FALSE;
+			break;
+		}
+		lso->lso_flags = 0;
+		if (sp->features & VIRTIO_NET_F_HOST_TSO4) {
+			lso->lso_flags |= LSO_TX_BASIC_TCP_IPV4;
+			lso->lso_basic_tcp_ipv4.lso_max = VIRTIONET_LSO_MAXLEN;
+		}
+		if (sp->features & VIRTIO_NET_F_HOST_TSO6) {
+			lso->lso_flags |= LSO_TX_BASIC_TCP_IPV6;
+			lso->lso_basic_tcp_ipv6.lso_max = VIRTIONET_LSO_MAXLEN;
+		}
+		result = (lso->lso_flags != 0) ? B_TRUE : B_FALSE;
+		break;
+	}
+	case MAC_CAPAB_RINGS: {
+		mac_capab_rings_t	*cap_rings = cap_data;
+
+		/* A single static group holds every queue pair */
+		cap_rings->mr_group_type = MAC_GROUP_TYPE_STATIC;
+		cap_rings->mr_rnum = sp->nqpairs;
+		cap_rings->mr_rget = virtionet_fill_ring;
+		cap_rings->mr_gaddring = NULL;
+		cap_rings->mr_gremring = NULL;
+		if (cap_rings->mr_type == MAC_RING_TYPE_RX) {
+			cap_rings->mr_gnum = 1;
+			cap_rings->mr_gget = virtionet_fill_group;
+		} else {
+			cap_rings->mr_gnum = 0;
+			cap_rings->mr_gget = NULL;
+		}
+		result = B_TRUE;
+		break;
+	}
+	default:
+		result = B_FALSE;
+	}
+	return (result);
+}
+
+
+#define	VIRTIONET_PROP_FEATURES		"_features"
+#define	VIRTIONET_PROP_RECVQSIZE	"_receiveqsize"
+#define	VIRTIONET_PROP_XMITQSIZE	"_transmitqsize"
+#define	VIRTIONET_PROP_CTRLQSIZE	"_controlqsize"
+#define	VIRTIONET_PROP_IMOD		"_intr_moderation"
+#define	VIRTIONET_PROP_IMOD_HIGH	"_intr_high_rate"
+#define	VIRTIONET_PROP_IMOD_LOW		"_intr_low_rate"
+#define	VIRTIONET_PROP_IMOD_USEC	"_intr_usec"
+
+/* Values of _intr_moderation, indexed by VIRTIONET_IMOD_* */
+static char *virtionet_imod_modes[] = {
+	"off",
+	"adaptive",
+	"fixed"
+};
+
+
+/*
+ * Rx descriptors posted. The legacy transport can't shrink the ring, only
+ * post fewer buffers than it holds.
+ */
+static uint16_t
+virtionet_rx_qsize(virtionet_state_t *sp, virtqueue_t *vqp)
+{
+	if (sp->rxq_size == 0) {
+		return (vqp->vq_size);
+	}
+	return (MIN(vqp->vq_size, sp->rxq_size));
+}
+
+
+/*
+ * Find the virtqueue a writable queue size property applies to and where
+ * the requested size is kept. Returns NULL for any other property, for
+ * the Tx and control queue sizes that only the modern transport can
+ * change, and when a failed reset left the device without queues.
+ */
+static virtqueue_t *
+virtionet_qsize_vq(virtionet_state_t *sp, const char *pname,
+    uint16_t **sizepp)
+{
+	virtqueue_t		*vqp;
+	uint16_t		*sizep;
+
+	if (strcmp(pname, VIRTIONET_PROP_RECVQSIZE) == 0) {
+		vqp = sp->rxrings[0].rr_vq;
+		sizep = &sp->rxq_size;
+	} else if (sp->modern &&
+	    (strcmp(pname, VIRTIONET_PROP_XMITQSIZE) == 0)) {
+		vqp = sp->txrings[0].tr_vq;
+		sizep = &sp->txq_size;
+	} else if (sp->modern &&
+	    (strcmp(pname, VIRTIONET_PROP_CTRLQSIZE) == 0)) {
+		vqp = sp->ctlq;
+		sizep = &sp->ctlq_size;
+	} else {
+		return (NULL);
+	}
+
+	if (sizepp != NULL) {
+		*sizepp = sizep;
+	}
+	return (vqp);
+}
+
+
+static int
+virtionet_setprop(void *arg, const char *prop_name, mac_prop_id_t pid,
+	uint_t pvalsize, const void *pval)
+{
+	virtionet_state_t	*sp = arg;
+	uint32_t		mtu;
+	int			rc;
+
+	switch (pid) {
+	case MAC_PROP_MTU:
+		ASSERT(pvalsize >= sizeof (uint32_t));
+		bcopy(pval, &mtu, sizeof (mtu));
+		mutex_enter(&sp->lock);
+		rc = virtionet_set_mtu(sp, mtu);
+		mutex_exit(&sp->lock);
+		break;
+	case MAC_PROP_PRIVATE:
+		mutex_enter(&sp->lock);
+		rc = virtionet_priv_setprop(sp, prop_name, pval);
+		mutex_exit(&sp->lock);
+		break;
+	default:
+		rc = ENOTSUP;
+	}
+	return (rc);
+}
+
+static int
+virtionet_priv_getprop(virtionet_state_t *sp, const char *pname,
+	uint_t pvalsize, void *pval)
+{
+	virtqueue_t		*rvqp = sp->rxrings[0].rr_vq;
+	virtqueue_t		*tvqp = sp->txrings[0].tr_vq;
+	int			rc = 0;
+
+	/* A failed queue size change leaves only the requested sizes */
+	if (strcmp(pname, VIRTIONET_PROP_FEATURES) == 0) {
+		(void) snprintf(pval, pvalsize, "0x%llx",
+		    (u_longlong_t)sp->features);
+	} else if (strcmp(pname, VIRTIONET_PROP_RECVQSIZE) == 0) {
+		(void) snprintf(pval, pvalsize, "0x%x", (rvqp != NULL) ?
+		    virtionet_rx_qsize(sp, rvqp) : sp->rxq_size);
+	} else if (strcmp(pname, VIRTIONET_PROP_XMITQSIZE) == 0) {
+		(void) snprintf(pval, pvalsize, "0x%x",
+		    (tvqp != NULL) ? tvqp->vq_size : sp->txq_size);
+	} else if (strcmp(pname, VIRTIONET_PROP_CTRLQSIZE) == 0) {
+		(void) snprintf(pval, pvalsize, "0x%x",
+		    (sp->ctlq != NULL) ? sp->ctlq->vq_size : sp->ctlq_size);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD) == 0) {
+		(void) snprintf(pval, pvalsize, "%s",
+		    virtionet_imod_modes[sp->imod_mode]);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_HIGH) == 0) {
+		(void) snprintf(pval, pvalsize, "%u", sp->imod_high);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_LOW) == 0) {
+		(void) snprintf(pval, pvalsize, "%u", sp->imod_low);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_USEC) == 0) {
+		(void) snprintf(pval, pvalsize, "%u", sp->imod_usec);
+	} else {
+		rc = ENOTSUP;
+	}
+
+	return (rc);
+}
+
+
+static int
+virtionet_getprop(void *arg, const char *pname, mac_prop_id_t pid,
+	uint_t psize, void *pval)
+{
+	virtionet_state_t	*sp = arg;
+	int			rc = 0;
+
+	switch (pid) {
+	case MAC_PROP_DUPLEX:
+		ASSERT(psize >= sizeof (link_duplex_t));
+		*(link_duplex_t *)pval = LINK_DUPLEX_FULL;
+		break;
+	case MAC_PROP_SPEED:
+		ASSERT(psize >= sizeof (uint64_t));
+		*(uint64_t *)pval = 1000 * 1000 * 1000;
+		break;
+	case MAC_PROP_STATUS:
+		ASSERT(psize >= sizeof (link_state_t));
+		*(link_state_t *)pval = virtionet_link_status(sp);
+		break;
+	case MAC_PROP_PRIVATE:
+		mutex_enter(&sp->lock);
+		rc = virtionet_priv_getprop(sp, pname, psize, pval);
+		mutex_exit(&sp->lock);
+		break;
+	default:
+		rc = ENOTSUP;
+	}
+	return (rc);
+}
+
+
+static void
+virtionet_priv_propinfo(virtionet_state_t *sp, const char *pname,
+	mac_prop_info_handle_t ph)
+{
+	virtqueue_t		*vqp;
+	char			valstr[16];
+
+	vqp = virtionet_qsize_vq(sp, pname, NULL);
+	if (strcmp(pname, VIRTIONET_PROP_IMOD) == 0) {
+		mac_prop_info_set_default_str(ph,
+		    virtionet_imod_modes[virtionet_imod_mode]);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_HIGH) == 0) {
+		(void) snprintf(valstr, sizeof (valstr), "%u",
+		    virtionet_imod_high_rate);
+		mac_prop_info_set_default_str(ph, valstr);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_LOW) == 0) {
+		(void) snprintf(valstr, sizeof (valstr), "%u",
+		    virtionet_imod_low_rate);
+		mac_prop_info_set_default_str(ph, valstr);
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_USEC) == 0) {
+		(void) snprintf(valstr, sizeof (valstr), "%u",
+		    virtionet_imod_usec);
+		mac_prop_info_set_default_str(ph, valstr);
+	} else if (vqp != NULL) {
+		/* The device maximum unless driver.conf says otherwise */
+		(void) snprintf(valstr, sizeof (valstr), "0x%x",
+		    vqp->vq_max_size);
+		mac_prop_info_set_default_str(ph, valstr);
+	} else if ((strcmp(pname, VIRTIONET_PROP_FEATURES) == 0) ||
+	    (strcmp(pname, VIRTIONET_PROP_RECVQSIZE) == 0) ||
+	    (strcmp(pname, VIRTIONET_PROP_XMITQSIZE) == 0) ||
+	    (strcmp(pname, VIRTIONET_PROP_CTRLQSIZE) == 0)) {
+		mac_prop_info_set_perm(ph, MAC_PROP_PERM_READ);
+		mac_prop_info_set_default_str(ph, "0x0");
+	} else {
+		cmn_err(CE_NOTE, "Unexpected private property %s",
+		    pname);
+	}
+}
+
+
+static void
+virtionet_propinfo(void *arg, const char *pname, mac_prop_id_t pid,
+	mac_prop_info_handle_t ph)
+{
+	virtionet_state_t	*sp = arg;
+
+	switch (pid) {
+	case MAC_PROP_DUPLEX:
+	case MAC_PROP_SPEED:
+	case MAC_PROP_STATUS:
+		mac_prop_info_set_perm(ph, MAC_PROP_PERM_READ);
+		break;
+	case MAC_PROP_MTU:
+		mac_prop_info_set_range_uint32(ph, ETHERMIN, sp->max_mtu);
+		break;
+	case MAC_PROP_PRIVATE:
+		virtionet_priv_propinfo(sp, pname, ph);
+		break;
+	default:
+		/* Do we need to do anything in this case ? */
+		;
+	}
+}
+
+
+#define	VIRTIONET_CALLBACKS	(MC_IOCTL | MC_GETCAPAB | MC_PROPERTIES)
+
+static mac_callbacks_t virtionet_mac_callbacks = {
+	.mc_callbacks	= VIRTIONET_CALLBACKS,
+	.mc_getstat	= virtionet_getstat,
+	.mc_start	= virtionet_start,
+	.mc_stop	= virtionet_stop,
+	.mc_setpromisc	= virtionet_setpromisc,
+	.mc_multicst	= virtionet_multicst,
+	.mc_unicst	= NULL,
+	.mc_tx		= NULL,
+	.mc_ioctl	= virtionet_ioctl,
+	.mc_getcapab	= virtionet_getcapab,
+	.mc_setprop	= virtionet_setprop,
+	.mc_getprop	= virtionet_getprop,
+	.mc_propinfo	= virtionet_propinfo
+};
+
+
+static char *virtionet_priv_props[] = {
+	VIRTIONET_PROP_FEATURES,
+	VIRTIONET_PROP_RECVQSIZE,
+	VIRTIONET_PROP_XMITQSIZE,
+	VIRTIONET_PROP_CTRLQSIZE,
+	VIRTIONET_PROP_IMOD,
+	VIRTIONET_PROP_IMOD_HIGH,
+	VIRTIONET_PROP_IMOD_LOW,
+	VIRTIONET_PROP_IMOD_USEC,
+	NULL
+};
+
+
+/* Register virtionet driver with GLDv3 framework */
+static int
+virtionet_mac_register(virtionet_state_t *sp)
+{
+	mac_register_t		*mp;
+	int			rc;
+
+	mp = mac_alloc(MAC_VERSION);
+	if (mp == NULL) {
+		return (DDI_FAILURE);
+	}
+
+	mp->m_type_ident	= MAC_PLUGIN_IDENT_ETHER;
+	mp->m_driver		= sp;
+	mp->m_dip		= sp->dip;
+	mp->m_instance		= 0;
+	mp->m_src_addr		= sp->addr;
+	mp->m_dst_addr		= NULL;
+	mp->m_callbacks		= &virtionet_mac_callbacks;
+	mp->m_min_sdu		= 0;
+	mp->m_max_sdu		= sp->mtu;
+	mp->m_margin		= VLAN_TAGSZ;
+	mp->m_priv_props	= virtionet_priv_props;
+	mp->m_v12n		= MAC_VIRT_LEVEL1;
+
+	rc = mac_register(mp, &sp->mh);
+	mac_free(mp);
+	if (rc != 0) {
+		return (DDI_FAILURE);
+	}
+
+	return (DDI_SUCCESS);
+}
+
+
+/* Unregister virtionet driver from GLDv3 framework */
+static int
+virtionet_mac_unregister(virtionet_state_t *sp)
+{
+	int			rc;
+
+	rc = mac_unregister(sp->mh);
+	if (rc != 0) {
+		return (DDI_FAILURE);
+	}
+
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * Validate that the device in hand is indeed virtio network device
+ */
+static int
+virtio_validate_pcidev(dev_info_t *dip)
+{
+	ddi_acc_handle_t	pcihdl;
+	int			rc;
+
+	rc = pci_config_setup(dip, &pcihdl);
+	if (rc != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	if (pci_config_get16(pcihdl, PCI_CONF_VENID) != VIRTIO_PCI_VENDOR) {
+		cmn_err(CE_WARN, "Incorrect PCI vendor id");
+		rc = DDI_FAILURE;
+	}
+
+	uint16_t devid = pci_config_get16(pcihdl, PCI_CONF_DEVID);
+	uint8_t revid = pci_config_get8(pcihdl, PCI_CONF_REVID);
+
+	/*
+	 * Transitional devices speak the legacy ABI, and may offer the
+	 * modern one as well, modern only devices start at ABI revision 1.
+	 */
+	if ((devid >= VIRTIO_PCI_DEVID_MIN) &&
+	    (devid <= VIRTIO_PCI_DEVID_MAX)) {
+		if (revid != VIRTIO_PCI_REV_ABIV0) {
+			cmn_err(CE_WARN, "Unsupported virtio ABI detected");
+			rc = DDI_FAILURE;
+		}
+	} else if ((devid >= VIRTIO_PCI_DEVID_MODERN) &&
+	    (devid <= VIRTIO_PCI_DEVID_MODERN_MAX)) {
+		if (revid < VIRTIO_PCI_REV_ABIV1) {
+			cmn_err(CE_WARN, "Unsupported virtio ABI detected");
+			rc = DDI_FAILURE;
+		}
+	} else {
+		cmn_err(CE_WARN, "Incorrect PCI device id");
+		rc = DDI_FAILURE;
+	}
+
+	pci_config_teardown(&pcihdl);
+	return (rc);
+}
+
+
+/*
+ * Read the features the device offers, the legacy transport only has the
+ * low 32 of them.
+ */
+static uint64_t
+virtio_get_features(virtionet_state_t *sp)
+{
+	uint64_t		features;
+
+	if (!sp->modern) {
+		return (VIRTIO_GET32(sp, VIRTIO_DEVICE_FEATURES));
+	}
+
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_DEVICE_FEATURES_SEL, 1);
+	features = VIRTIO_GET32(sp, VIRTIO_COMMON_DEVICE_FEATURES);
+	features <<= 32;
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_DEVICE_FEATURES_SEL, 0);
+	features |= VIRTIO_GET32(sp, VIRTIO_COMMON_DEVICE_FEATURES);
+
+	return (features);
+}
+
+
+/*
+ * Tell the device which features are used. A modern device may still
+ * reject the set, it doesn't keep FEATURES_OK then.
+ */
+static int
+virtio_set_features(virtionet_state_t *sp, uint64_t features)
+{
+	if (!sp->modern) {
+		VIRTIO_PUT32(sp, VIRTIO_GUEST_FEATURES, (uint32_t)features);
+		return (DDI_SUCCESS);
+	}
+
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_GUEST_FEATURES_SEL, 0);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_GUEST_FEATURES, (uint32_t)features);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_GUEST_FEATURES_SEL, 1);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_GUEST_FEATURES,
+	    (uint32_t)(features >> 32));
+
+	VIRTIO_DEV_SET(sp, VIRTIO_DEV_STATUS_FEATURES_OK);
+	if (!(VIRTIO_DEV_STATUS(sp) & VIRTIO_DEV_STATUS_FEATURES_OK)) {
+		return (DDI_FAILURE);
+	}
+
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * Validate that the device in hand is indeed virtio network device
+ */
+static int
+virtio_validate_netdev(virtionet_state_t *sp)
+{
+	cmn_err(CE_CONT, "Device Features 0x%llX\n",
+	    (u_longlong_t)virtio_get_features(sp));
+	cmn_err(CE_CONT, "Device Status 0x%X\n", VIRTIO_DEV_STATUS(sp));
+	cmn_err(CE_CONT, "ISR Status 0x%X\n", VIRTIO_ISR(sp));
+
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * Negotiate the feature set with the device
+ * Return
+ *        DDI_SUCCESS if succesfuly negotiated non-zero feature set
+ *        DDI_FAILURE otherwise
+ */
+static int
+virtionet_negotiate_features(virtionet_state_t *sp)
+{
+	sp->features = virtio_get_features(sp);
+	sp->features &= VIRTIONET_GUEST_FEATURES;
+	/* The modern transport can only be used by VERSION_1 drivers */
+	if (sp->modern && !(sp->features & VIRTIO_F_VERSION_1)) {
+		return (DDI_FAILURE);
+	}
+	/* Multiqueue is configured through the control queue */
+	if (!(sp->features & VIRTIO_NET_F_CTRL_VQ)) {
+		sp->features &= ~VIRTIO_NET_F_MQ;
+	}
+	if (sp->features != 0) {
+		/* If there any features we support let device know them */
+		if (virtio_set_features(sp, sp->features) != DDI_SUCCESS) {
+			return (DDI_FAILURE);
+		}
+		/*
+		 * Mergeable Rx buffers extend the header on both queues,
+		 * VERSION_1 devices always use the longer one.
+		 */
+		if (sp->features &
+		    (VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_VERSION_1)) {
+			sp->hdrlen = sizeof (virtio_net_hdr_rxbuf_t);
+		} else {
+			sp->hdrlen = sizeof (virtio_net_hdr_t);
+		}
+		return (DDI_SUCCESS);
+	} else {
+		/* otherwise report failure to negotiate anything */
+		return (DDI_FAILURE);
+	}
+}
+
+
+static void
+virtionet_get_macaddr(virtionet_state_t *sp)
+{
+	if (sp->features & VIRTIO_NET_F_MAC) {
+		ddi_rep_get8(sp->devhandle, sp->addr,
+		    (uint8_t *)(sp->devaddr + VIRTIO_NET_CFG_MAC),
+		    ETHERADDRL, DDI_DEV_AUTOINCR);
+	} else {
+		/* TODO Should be random, but hardcoded for now */
+		sp->addr[0] = 0;
+		sp->addr[1] = 1;
+		sp->addr[2] = 2;
+		sp->addr[3] = 3;
+		sp->addr[4] = 4;
+		sp->addr[5] = 5;
+	}
+
+#if defined(DEBUG)
+	cmn_err(CE_NOTE, "Using mac address = %x:%x:%x:%x:%x:%x",
+	    sp->addr[0], sp->addr[1], sp->addr[2],
+	    sp->addr[3], sp->addr[4], sp->addr[5]);
+#endif
+}
+
+
+/*
+ * Pick the number of Rx/Tx queue pairs. With MSI-X every queue needs its
+ * own vector, so this has to be known before interrupts are allocated.
+ */
+static void
+virtionet_get_qpairs(virtionet_state_t *sp)
+{
+	int			nintr;
+	uint_t			n;
+
+	sp->max_qpairs = 1;
+	if (sp->features & VIRTIO_NET_F_MQ) {
+		sp->max_qpairs = ddi_get16(sp->devhandle,
+		    (uint16_t *)(sp->devaddr + VIRTIO_NET_CFG_MAX_VQ_PAIRS));
+		sp->max_qpairs = MAX(sp->max_qpairs, 1);
+	}
+
+	n = MIN(sp->max_qpairs, VIRTIONET_MAX_QPAIRS);
+	n = MIN(n, ncpus);
+	if (virtionet_qpairs != 0) {
+		n = MIN(n, virtionet_qpairs);
+	}
+	if ((ddi_intr_get_nintrs(sp->dip, DDI_INTR_TYPE_MSIX, &nintr) ==
+	    DDI_SUCCESS) && (nintr >= VIRTIONET_MSIX_NVEC(1))) {
+		n = MIN(n, (nintr - 1) / 2);
+	}
+	sp->nqpairs = MAX(n, 1);
+}
+
+
+/* Take the MTU limit from the device if it reports one */
+static void
+virtionet_get_mtu(virtionet_state_t *sp)
+{
+	sp->max_mtu = VIRTIONET_MAX_MTU;
+
+	if (sp->features & VIRTIO_NET_F_MTU) {
+		sp->max_mtu = ddi_get16(sp->devhandle,
+		    (uint16_t *)(sp->devaddr + VIRTIO_NET_CFG_MTU));
+		sp->max_mtu = MAX(sp->max_mtu, ETHERMIN);
+	}
+
+	sp->mtu = MIN(ETHERMTU, sp->max_mtu);
+}
+
+
+/*
+ * Queue sizes asked for in driver.conf. Sizes that aren't a power of two
+ * or are too small are ignored, too large ones stop at the device maximum
+ * when the queues are set up.
+ */
+static void
+virtionet_get_qsizes(virtionet_state_t *sp)
+{
+	static char		*names[] = {
+		"receiveqsize", "transmitqsize", "controlqsize"
+	};
+	uint16_t		*sizes[] = {
+		&sp->rxq_size, &sp->txq_size, &sp->ctlq_size
+	};
+	int			val;
+
+	for (uint_t i = 0; i < 3; i++) {
+		val = ddi_prop_get_int(DDI_DEV_T_ANY, sp->dip,
+		    DDI_PROP_DONTPASS, names[i], 0);
+		if (val == 0) {
+			continue;
+		}
+		if (!ISP2(val) || (val < VIRTIONET_MIN_QSIZE) ||
+		    (val > VIRTIONET_MAX_QSIZE)) {
+			cmn_err(CE_WARN, "Ignoring %s %d in driver.conf",
+			    names[i], val);
+			continue;
+		}
+		*sizes[i] = (uint16_t)val;
+	}
+}
+
+
+/*
+ * Return a loaned Rx buffer. Called by the stack when the mblk is freed,
+ * possibly on any CPU, so the buffer is pushed onto the recycle list
+ * without a lock. virtionet_rxbuf_get() takes the whole list at once.
+ */
+static void
+virtionet_rxbuf_free(caddr_t arg)
+{
+	virtionet_rxbuf_t	*rbp = (virtionet_rxbuf_t *)arg;
+	virtionet_rxring_t	*rxr = rbp->rb_rxr;
+	virtionet_rxbuf_t	*head;
+
+	do {
+		head = rxr->rr_recycle;
+		rbp->rb_next = head;
+	} while (atomic_cas_ptr(&rxr->rr_recycle, head, rbp) != head);
+
+	atomic_dec_32(&rxr->rr_sp->rx_nloaned);
+}
+
+
+/* Get a spare Rx buffer, NULL if all of them are loaned */
+static virtionet_rxbuf_t *
+virtionet_rxbuf_get(virtionet_rxring_t *rxr)
+{
+	virtionet_rxbuf_t	*rbp;
+
+	if (rxr->rr_free == NULL) {
+		rxr->rr_free = atomic_swap_ptr(&rxr->rr_recycle, NULL);
+	}
+
+	rbp = rxr->rr_free;
+	if (rbp != NULL) {
+		rxr->rr_free = rbp->rb_next;
+		rbp->rb_next = NULL;
+	}
+
+	return (rbp);
+}
+
+
+/* Put a list of unused spare Rx buffers back */
+static void
+virtionet_rxbuf_put(virtionet_rxring_t *rxr, virtionet_rxbuf_t *rbp)
+{
+	virtionet_rxbuf_t	*next;
+
+	for (; rbp != NULL; rbp = next) {
+		next = rbp->rb_next;
+		rbp->rb_next = rxr->rr_free;
+		rxr->rr_free = rbp;
+	}
+}
+
+
+/*
+ * Get 'n' spare Rx buffers as a list.
+ * Returns NULL, and takes nothing, if there are not enough of them.
+ */
+static virtionet_rxbuf_t *
+virtionet_rxbuf_reserve(virtionet_rxring_t *rxr, uint_t n)
+{
+	virtionet_rxbuf_t	*list = NULL;
+	virtionet_rxbuf_t	*rbp;
+
+	for (uint_t i = 0; i < n; i++) {
+		rbp = virtionet_rxbuf_get(rxr);
+		if (rbp == NULL) {
+			virtionet_rxbuf_put(rxr, list);
+			return (NULL);
+		}
+		rbp->rb_next = list;
+		list = rbp;
+	}
+
+	return (list);
+}
+
+
+/*
+ * Point the descriptors of the Rx slot starting at 'head' to the buffers
+ * currently assigned to it. A slot of more than one buffer is either a
+ * direct descriptor chain or a single descriptor with an indirect table.
+ */
+static void
+virtionet_rx_fill_slot(virtionet_rxring_t *rxr, uint16_t head)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtqueue_t		*vqp = rxr->rr_vq;
+	virtionet_rxbuf_t	**rbpp;
+	virtionet_buf_t		*bp;
+	vring_desc_t		*dp;
+	uint_t			nbufs = sp->rx_slotbufs;
+	uint16_t		flags;
+	uint16_t		idx;
+
+	rbpp = &rxr->rr_slots[head * nbufs];
+
+	if (rxr->rr_ind != NULL) {
+		bp = &rxr->rr_ind->vp_bufs[head];
+		dp = (vring_desc_t *)bp->vb_addr;
+		for (uint_t i = 0; i < nbufs; i++) {
+			virtio_vq_set_indirect(vqp, dp, i, nbufs,
+			    rbpp[i]->rb_buf->vb_paddr + sp->rx_bufoff,
+			    sp->rx_bufsize - sp->rx_bufoff, VRING_DESC_F_WRITE);
+		}
+		virtionet_buf_sync(bp, 0, nbufs * sizeof (*dp),
+		    DDI_DMA_SYNC_FORDEV);
+
+		vqp->vr_desc[head].addr = bp->vb_paddr;
+		vqp->vr_desc[head].len = nbufs * sizeof (*dp);
+		vqp->vr_desc[head].flags = VRING_DESC_F_INDIRECT;
+	} else {
+		idx = head;
+		for (uint_t i = 0; i < nbufs; i++) {
+			flags = VRING_DESC_F_WRITE;
+			if (i + 1 < nbufs) {
+				flags |= VRING_DESC_F_NEXT;
+			}
+			vqp->vr_desc[idx].addr =
+			    rbpp[i]->rb_buf->vb_paddr + sp->rx_bufoff;
+			vqp->vr_desc[idx].len = sp->rx_bufsize - sp->rx_bufoff;
+			vqp->vr_desc[idx].flags = flags;
+			idx = vqp->vr_desc[idx].next;
+		}
+	}
+
+	virtio_vq_sync_chain(vqp, head);
+}
+
+
+/*
+ * Hand all Rx slots over to the device.
+ * The buffers are assigned to the slots in order, every slot keeps its
+ * descriptors for good, only the buffers behind them change.
+ */
+static void
+virtionet_rx_post(virtionet_rxring_t *rxr)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtqueue_t		*vqp = rxr->rr_vq;
+	uint_t			ndesc;
+	uint16_t		head;
+
+	ndesc = (rxr->rr_ind != NULL) ? 1 : sp->rx_slotbufs;
+
+	for (uint_t i = 0; i < rxr->rr_nslots; i++) {
+		head = virtio_vq_alloc_chain(vqp, ndesc);
+		for (uint_t j = 0; j < sp->rx_slotbufs; j++) {
+			rxr->rr_slots[head * sp->rx_slotbufs + j] =
+			    &rxr->rr_bufs[i * sp->rx_slotbufs + j];
+		}
+		virtionet_rx_fill_slot(rxr, head);
+		virtio_vq_push(vqp, head);
+	}
+
+	(void) virtio_vq_publish(vqp);
+}
+
+
+/*
+ * Complete the checksum of a frame flagged NEEDS_CSUM: the field at
+ * csum_start + csum_offset only holds the pseudo-header sum, and the
+ * one's complement sum from csum_start to the end of the frame goes
+ * there, like the device would have done on transmit. The sum is left
+ * to the stack's own ip_cksum().
+ * Returns B_FALSE if the offsets don't fit the frame.
+ */
+static boolean_t
+virtionet_rx_cksum_finish(mblk_t *mp, size_t start, size_t stuff)
+{
+	mblk_t			*bp = mp;
+	uint16_t		csum;
+	size_t			off;
+
+	if (start + stuff + sizeof (uint16_t) > msgdsize(mp)) {
+		return (B_FALSE);
+	}
+
+	/* Sum from the buffer csum_start falls in */
+	for (off = start; off >= MBLKL(bp); bp = bp->b_cont) {
+		off -= MBLKL(bp);
+	}
+	csum = IP_CSUM(bp, (int)off, 0);
+	if (csum == 0) {
+		csum = 0xFFFF;
+	}
+
+	/* The field may straddle two buffers of a merged frame */
+	off += stuff;
+	for (uint_t i = 0; i < sizeof (csum); i++, off++) {
+		while (off >= MBLKL(bp)) {
+			off -= MBLKL(bp);
+			bp = bp->b_cont;
+		}
+		bp->b_rptr[off] = ((uint8_t *)&csum)[i];
+	}
+
+	return (B_TRUE);
+}
+
+
+/*
+ * Pass the checksum status reported by the device on to the stack.
+ * Frames flagged NEEDS_CSUM never left the host and carry only the
+ * partial (pseudo-header) sum, it is finished here before the frame is
+ * handed up as verified.
+ */
+static void
+virtionet_rx_cksum(virtionet_state_t *sp, const virtio_net_hdr_t *hdr,
+    mblk_t *mp)
+{
+	if ((sp->features & VIRTIO_NET_F_GUEST_CSUM) == 0) {
+		return;
+	}
+
+	if (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+		if (virtionet_rx_cksum_finish(mp, hdr->csum_start,
+		    hdr->csum_offset)) {
+			mac_hcksum_set(mp, 0, 0, 0, 0, HCK_FULLCKSUM_OK);
+		}
+	} else if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+		mac_hcksum_set(mp, 0, 0, 0, 0, HCK_FULLCKSUM_OK);
+	}
+}
+
+
+/*
+ * Loan the first 'nfrags' buffers of the frame in rx_frags up the stack,
+ * replacing them with the 'spares'. A frame spanning several buffers
+ * becomes a b_cont chain.
+ * Returns NULL if desballoc() fails, the frame is lost in that case.
+ */
+static mblk_t *
+virtionet_rx_loan(virtionet_rxring_t *rxr, uint_t nfrags,
+    virtionet_rxbuf_t *spares)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtionet_rxfrag_t	*rfp = rxr->rr_frags;
+	virtionet_rxbuf_t	*rbp;
+	mblk_t			*mp = NULL;
+	mblk_t			**mpp = &mp;
+	mblk_t			*bp;
+	size_t			off = sp->rx_bufoff + sp->hdrlen;
+	uint_t			i;
+
+	for (i = 0; i < nfrags; i++) {
+		rbp = *rfp[i].rf_slot;
+		bp = desballoc((unsigned char *)rbp->rb_buf->vb_addr,
+		    sp->rx_bufsize, 0, &rbp->rb_frtn);
+		if (bp == NULL) {
+			break;
+		}
+		atomic_inc_32(&sp->rx_nloaned);
+
+		bp->b_rptr += off;
+		bp->b_wptr = bp->b_datap->db_base + sp->rx_bufoff +
+		    rfp[i].rf_len;
+		off = sp->rx_bufoff;
+
+		*mpp = bp;
+		mpp = &bp->b_cont;
+
+		/* Put a spare buffer on the ring instead */
+		*rfp[i].rf_slot = spares;
+		spares = spares->rb_next;
+		(*rfp[i].rf_slot)->rb_next = NULL;
+	}
+
+	virtionet_rxbuf_put(rxr, spares);
+
+	/* Point the slots, possibly several per frame, to the new buffers */
+	for (uint_t j = 0; j < i; j++) {
+		if ((j == 0) || (rfp[j].rf_head != rfp[j - 1].rf_head)) {
+			virtionet_rx_fill_slot(rxr, rfp[j].rf_head);
+		}
+	}
+
+	if (i < nfrags) {
+		/* The loaned buffers come back through the recycle list */
+		freemsg(mp);
+		return (NULL);
+	}
+
+	return (mp);
+}
+
+
+/* Copy the 'flen' bytes long frame in rx_frags into a new mblk */
+static mblk_t *
+virtionet_rx_copy(virtionet_rxring_t *rxr, uint_t nfrags, size_t flen)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtionet_rxfrag_t	*rfp = rxr->rr_frags;
+	mblk_t			*mp;
+	size_t			off = sp->hdrlen;
+
+	mp = allocb(flen + VIRTIONET_IPHDR_ALIGN, 0);
+	if (mp == NULL) {
+		return (NULL);
+	}
+	mp->b_rptr += VIRTIONET_IPHDR_ALIGN;
+	mp->b_wptr = mp->b_rptr;
+
+	for (uint_t i = 0; i < nfrags; i++) {
+		bcopy((*rfp[i].rf_slot)->rb_buf->vb_addr + sp->rx_bufoff + off,
+		    mp->b_wptr, rfp[i].rf_len - off);
+		mp->b_wptr += rfp[i].rf_len - off;
+		off = 0;
+	}
+
+	return (mp);
+}
+
+
+/*
+ * Turn the 'len' bytes long frame gathered in rx_frags into an mblk.
+ * Large frames are loaned up the stack if there are spare buffers to put
+ * on the ring instead, otherwise the frame is copied.
+ * Returns NULL if there is no memory for the frame.
+ */
+static mblk_t *
+virtionet_rx_frame(virtionet_rxring_t *rxr, uint_t nfrags, uint32_t len)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtionet_rxbuf_t	*spares;
+	virtio_net_hdr_t	hdr;
+	mblk_t			*mp;
+	size_t			flen;
+
+	ASSERT(len > sp->hdrlen);
+
+	/* Strip the virtio header, the stack only needs the frame */
+	hdr = *(virtio_net_hdr_t *)
+	    ((*rxr->rr_frags[0].rf_slot)->rb_buf->vb_addr + sp->rx_bufoff);
+	flen = len - sp->hdrlen;
+
+	if (!sp->rx_noloan && (flen > virtionet_rx_copybreak) &&
+	    ((spares = virtionet_rxbuf_reserve(rxr, nfrags)) != NULL)) {
+		mp = virtionet_rx_loan(rxr, nfrags, spares);
+	} else {
+		mp = virtionet_rx_copy(rxr, nfrags, flen);
+	}
+	if (mp == NULL) {
+		rxr->rr_norcvbuf++;
+		return (NULL);
+	}
+
+	virtionet_rx_cksum(sp, &hdr, mp);
+
+	rxr->rr_ipackets++;
+	rxr->rr_rbytes += flen;
+
+	return (mp);
+}
+
+
+/*
+ * Append the buffers of the Rx slot at 'head', 'len' bytes received into
+ * it, to the frame gathered in rx_frags and sync them for the CPU.
+ * Returns the new number of fragments, 0 if the slot can't be part of
+ * the frame.
+ */
+static uint_t
+virtionet_rx_gather(virtionet_rxring_t *rxr, uint_t nfrags, uint16_t head,
+    uint32_t len)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtionet_rxfrag_t	*rfp;
+	size_t			bufsize = sp->rx_bufsize - sp->rx_bufoff;
+	uint_t			nbufs;
+
+	nbufs = howmany(len, bufsize);
+	if ((nbufs == 0) || (nbufs > sp->rx_slotbufs) ||
+	    (nfrags + nbufs > VIRTIONET_RX_MAXFRAGS)) {
+		return (0);
+	}
+
+	for (uint_t i = 0; i < nbufs; i++) {
+		rfp = &rxr->rr_frags[nfrags++];
+		rfp->rf_slot = &rxr->rr_slots[head * sp->rx_slotbufs + i];
+		rfp->rf_len = MIN(len, bufsize);
+		rfp->rf_head = head;
+		virtionet_buf_sync((*rfp->rf_slot)->rb_buf, sp->rx_bufoff,
+		    rfp->rf_len, DDI_DMA_SYNC_FORKERNEL);
+		len -= rfp->rf_len;
+	}
+
+	return (nfrags);
+}
+
+
+/*
+ * Harvest the Rx used ring, stopping once frames of at least "budget"
+ * bytes have been picked up unless it is VIRTIONET_RX_NOLIMIT.
+ * Every completed slot is given back to the device in one batch, the
+ * received frames are returned as a single b_next chain. With mergeable
+ * Rx buffers a frame takes num_buffers consecutive used entries, of one
+ * buffer each. rr_nwait is left at the number of used entries the
+ * first frame still on the ring needs, 1 unless it is only partly there.
+ */
+static mblk_t *
+virtionet_rx(virtionet_rxring_t *rxr, int budget)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtqueue_t		*vqp = rxr->rr_vq;
+	mblk_t			*mp;
+	mblk_t			*mphead = NULL;
+	mblk_t			**mptail = &mphead;
+	virtio_net_hdr_rxbuf_t	*hdr;
+	uint16_t		head;
+	uint16_t		nused;
+	uint32_t		len;
+	uint32_t		flen;
+	uint_t			nfrags;
+	size_t			picked = 0;
+
+	ASSERT(MUTEX_HELD(&rxr->rr_lock));
+
+	rxr->rr_nwait = 1;
+	while (virtio_vq_used(vqp, 0, &head, &len)) {
+		if ((budget != VIRTIONET_RX_NOLIMIT) &&
+		    (picked >= (size_t)budget)) {
+			break;
+		}
+
+		nused = 1;
+		nfrags = (len < sp->hdrlen) ? 0 :
+		    virtionet_rx_gather(rxr, 0, head, len);
+
+		if ((nfrags != 0) && (sp->features & VIRTIO_NET_F_MRG_RXBUF)) {
+			hdr = (virtio_net_hdr_rxbuf_t *)
+			    ((*rxr->rr_frags[0].rf_slot)->rb_buf->vb_addr +
+			    sp->rx_bufoff);
+			nused = hdr->num_buffers;
+			if ((nused == 0) || (nused > VIRTIONET_RX_MAXFRAGS) ||
+			    (nused > vqp->vq_size)) {
+				/* Bogus count, only drop the first buffer */
+				nused = 1;
+				nfrags = 0;
+			} else if (!virtio_vq_used(vqp, nused - 1, &head,
+			    &flen)) {
+				/* The rest of the frame is not there yet */
+				rxr->rr_nwait = nused;
+				break;
+			}
+			for (uint16_t i = 1; (i < nused) && (nfrags != 0);
+			    i++) {
+				(void) virtio_vq_used(vqp, i, &head, &flen);
+				len += flen;
+				nfrags = virtionet_rx_gather(rxr, nfrags,
+				    head, flen);
+			}
+		}
+
+		if ((nfrags == 0) || (len <= sp->hdrlen)) {
+			rxr->rr_ierrors++;
+		} else {
+			mp = virtionet_rx_frame(rxr, nfrags, len);
+			if (mp != NULL) {
+				*mptail = mp;
+				mptail = &mp->b_next;
+				picked += len - sp->hdrlen;
+			}
+		}
+
+		/* The slots are free again, hand them straight back */
+		for (uint16_t i = 0; i < nused; i++) {
+			head = virtio_vq_used_next(vqp);
+			virtio_vq_push(vqp, head);
+		}
+	}
+
+	if (virtio_vq_publish(vqp)) {
+		virtio_vq_kick(sp, vqp);
+	}
+
+	return (mphead);
+}
+
+
+static uint_t
+virtionet_rx_intr(caddr_t arg1, caddr_t arg2)
+{
+	virtionet_rxring_t	*rxr = (virtionet_rxring_t *)arg1;
+	virtqueue_t		*vqp;
+	mblk_t			*mp;
+	boolean_t		arm = B_FALSE;
+
+	/*
+	 * Checked without the lock: if the ring is being polled the frames
+	 * are left for mri_poll, and the shared FIXED interrupt gets here
+	 * for every ring. A moderated ring is always processed, an idle run
+	 * of the timer is what lets it leave moderation.
+	 */
+	vqp = rxr->rr_vq;
+	if (rxr->rr_polling || (vqp == NULL) ||
+	    (!rxr->rr_imod.im_on && !virtio_vq_has_used(vqp))) {
+		return (DDI_INTR_CLAIMED);
+	}
+
+	/* A softint may still run while virtionet_vq_reset() is under way */
+	mutex_enter(&rxr->rr_lock);
+	if (rxr->rr_vq == NULL) {
+		mutex_exit(&rxr->rr_lock);
+		return (DDI_INTR_CLAIMED);
+	}
+
+	for (;;) {
+		mp = virtionet_rx(rxr, VIRTIONET_RX_NOLIMIT);
+		if (mp != NULL) {
+			mutex_exit(&rxr->rr_lock);
+			mac_rx_ring(rxr->rr_sp->mh, rxr->rr_mrh, mp,
+			    rxr->rr_gen);
+			mutex_enter(&rxr->rr_lock);
+		}
+		if (rxr->rr_polling || (rxr->rr_vq == NULL)) {
+			break;
+		}
+		if (virtionet_imod_update(rxr->rr_sp, &rxr->rr_imod,
+		    rxr->rr_ipackets, &arm)) {
+			/* The moderation timer picks up what comes next */
+			virtio_vq_intr_disarm(rxr->rr_vq);
+			break;
+		}
+		/* Not until the whole of a partly received frame is there */
+		if (virtio_vq_intr_arm(rxr->rr_vq, rxr->rr_nwait)) {
+			break;
+		}
+	}
+	mutex_exit(&rxr->rr_lock);
+
+	if (arm) {
+		virtionet_imod_arm(rxr->rr_sp, rxr->rr_imod.im_interval);
+	}
+
+	return (DDI_INTR_CLAIMED);
+}
+
+
+static uint_t
+virtionet_tx_intr(caddr_t arg1, caddr_t arg2)
+{
+	virtionet_txring_t	*txr = (virtionet_txring_t *)arg1;
+
+	virtionet_tx_update(txr);
+
+	return (DDI_INTR_CLAIMED);
+}
+
+
+static uint_t
+virtionet_cfg_intr(caddr_t arg1, caddr_t arg2)
+{
+	virtionet_state_t	*sp = (virtionet_state_t *)arg1;
+
+	mac_link_update(sp->mh, virtionet_link_status(sp));
+
+	return (DDI_INTR_CLAIMED);
+}
+
+
+/*
+ * The single FIXED interrupt is shared by all the queues and config
+ * changes, the ISR tells them apart. With MSI-X every one of them has its
+ * own vector and the ISR is never read.
+ */
+static uint_t
+virtionet_intr(caddr_t arg1, caddr_t arg2)
+{
+	virtionet_state_t	*sp = (virtionet_state_t *)arg1;
+	uint8_t			intr;
+
+	/* Autoclears the ISR */
+	intr = VIRTIO_ISR(sp);
+
+	if (intr) {
+		if (intr & VIRTIO_ISR_VQ) {
+			/* VQ update */
+			intr &= (~VIRTIO_ISR_VQ);
+			for (uint_t i = 0; i < sp->nqpairs; i++) {
+				(void) virtionet_rx_intr(
+				    (caddr_t)&sp->rxrings[i], arg2);
+				(void) virtionet_tx_intr(
+				    (caddr_t)&sp->txrings[i], arg2);
+			}
+		}
+		if (intr & VIRTIO_ISR_CFG) {
+			/* Configuration update */
+			intr &= (~VIRTIO_ISR_CFG);
+			mac_link_update(sp->mh, virtionet_link_status(sp));
+		}
+		/* Let us know if there is still something interrupting */
+		if (intr) {
+			cmn_err(CE_WARN, "Unknown interrupt 0x%X", intr);
+		}
+		return (DDI_INTR_CLAIMED);
+	} else {
+		return (DDI_INTR_UNCLAIMED);
+	}
+}
+
+
+/*
+ * Moderation timer. Processes the moderated queues the way their
+ * interrupts would and comes back after the shortest of their intervals
+ * as long as any of them is still moderated.
+ */
+static void
+virtionet_imod_tick(void *arg)
+{
+	virtionet_state_t	*sp = arg;
+	virtionet_rxring_t	*rxr;
+	virtionet_txring_t	*txr;
+	hrtime_t		interval = CY_INFINITY;
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		rxr = &sp->rxrings[i];
+		txr = &sp->txrings[i];
+		if (rxr->rr_imod.im_on) {
+			(void) virtionet_rx_intr((caddr_t)rxr, NULL);
+		}
+		if (txr->tr_imod.im_on) {
+			virtionet_tx_update(txr);
+		}
+	}
+
+	mutex_enter(&sp->imod_lock);
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		rxr = &sp->rxrings[i];
+		txr = &sp->txrings[i];
+		if (rxr->rr_imod.im_on) {
+			interval = MIN(interval, rxr->rr_imod.im_interval);
+		}
+		if (txr->tr_imod.im_on) {
+			interval = MIN(interval, txr->tr_imod.im_interval);
+		}
+	}
+	if ((sp->imod_cyclic != CYCLIC_NONE) && (sp->imod_nqueues != 0)) {
+		(void) cyclic_reprogram(sp->imod_cyclic,
+		    gethrtime() + interval);
+	}
+	mutex_exit(&sp->imod_lock);
+}
+
+
+/*
+ * Add the moderation timer of the queues just set up. It stays idle until
+ * a queue is moderated, and its sub-tick intervals are why it is a cyclic
+ * rather than a timeout(9F).
+ */
+static void
+virtionet_imod_start(virtionet_state_t *sp)
+{
+	cyc_handler_t		hdlr;
+	cyc_time_t		when;
+	cyclic_id_t		cid;
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		bzero(&sp->rxrings[i].rr_imod, sizeof (virtionet_imod_t));
+		bzero(&sp->txrings[i].tr_imod, sizeof (virtionet_imod_t));
+	}
+
+	hdlr.cyh_func = virtionet_imod_tick;
+	hdlr.cyh_arg = sp;
+	hdlr.cyh_level = CY_LOW_LEVEL;
+
+	when.cyt_when = CY_INFINITY;
+	when.cyt_interval = CY_INFINITY;
+
+	mutex_enter(&cpu_lock);
+	cid = cyclic_add(&hdlr, &when);
+	mutex_exit(&cpu_lock);
+
+	mutex_enter(&sp->imod_lock);
+	sp->imod_nqueues = 0;
+	sp->imod_cyclic = cid;
+	mutex_exit(&sp->imod_lock);
+}
+
+
+/*
+ * Remove the moderation timer, waiting for a run in progress. Once
+ * imod_cyclic is cleared nothing reprograms it.
+ */
+static void
+virtionet_imod_stop(virtionet_state_t *sp)
+{
+	cyclic_id_t		cid;
+
+	mutex_enter(&sp->imod_lock);
+	cid = sp->imod_cyclic;
+	sp->imod_cyclic = CYCLIC_NONE;
+	mutex_exit(&sp->imod_lock);
+
+	if (cid == CYCLIC_NONE) {
+		return;
+	}
+
+	mutex_enter(&cpu_lock);
+	cyclic_remove(cid);
+	mutex_exit(&cpu_lock);
+}
+
+
+/* Device attributes */
+static ddi_device_acc_attr_t virtio_devattr = {
+	.devacc_attr_version		= DDI_DEVICE_ATTR_V0,
+	.devacc_attr_endian_flags	= DDI_STRUCTURE_LE_ACC,
+	.devacc_attr_dataorder		= DDI_STRICTORDER_ACC,
+	.devacc_attr_access		= DDI_DEFAULT_ACC
+};
+
+
+/* virtqueue buffer access attributes */
+static ddi_device_acc_attr_t virtio_native_attr = {
+	.devacc_attr_version		= DDI_DEVICE_ATTR_V0,
+	.devacc_attr_endian_flags	= DDI_NEVERSWAP_ACC,
+	.devacc_attr_dataorder		= DDI_STRICTORDER_ACC,
+	.devacc_attr_access		= DDI_DEFAULT_ACC
+};
+
+
+static ddi_dma_attr_t vq_dma_attr = {
+	.dma_attr_version		= DMA_ATTR_V0,
+	.dma_attr_addr_lo		= 0,
+	.dma_attr_addr_hi		= 0xFFFFFFFFFFFFFFFFULL,
+	.dma_attr_count_max		= 0xFFFFFFFFU,
+	.dma_attr_align			= 4096,
+	.dma_attr_burstsizes		= 1,
+	.dma_attr_minxfer		= 1,
+	.dma_attr_maxxfer		= 0xFFFFFFFFU,
+	.dma_attr_seg			= 0xFFFFFFFFU,
+	.dma_attr_sgllen		= 1,
+	.dma_attr_granular		= 1,
+	.dma_attr_flags			= DDI_DMA_FORCE_PHYSICAL
+};
+
+
+/* Attributes for the page-sized chunks the buffer pools are made of */
+static ddi_dma_attr_t chunk_dma_attr = {
+	.dma_attr_version		= DMA_ATTR_V0,
+	.dma_attr_addr_lo		= 0,
+	.dma_attr_addr_hi		= 0xFFFFFFFFFFFFFFFFULL,
+	.dma_attr_count_max		= 0xFFFFFFFFU,
+	.dma_attr_align			= 4096,
+	.dma_attr_burstsizes		= 1,
+	.dma_attr_minxfer		= 1,
+	.dma_attr_maxxfer		= 0xFFFFFFFFU,
+	.dma_attr_seg			= 0xFFFFFFFFU,
+	.dma_attr_sgllen		= 1,
+	.dma_attr_granular		= 1,
+	.dma_attr_flags			= DDI_DMA_FORCE_PHYSICAL
+};
+
+
+/* Attributes for binding outgoing mblk fragments */
+static ddi_dma_attr_t tx_dma_attr = {
+	.dma_attr_version		= DMA_ATTR_V0,
+	.dma_attr_addr_lo		= 0,
+	.dma_attr_addr_hi		= 0xFFFFFFFFFFFFFFFFULL,
+	.dma_attr_count_max		= 0xFFFFFFFFU,
+	.dma_attr_align			= 1,
+	.dma_attr_burstsizes		= 1,
+	.dma_attr_minxfer		= 1,
+	.dma_attr_maxxfer		= 0xFFFFFFFFU,
+	.dma_attr_seg			= 0xFFFFFFFFU,
+	.dma_attr_sgllen		= VIRTIONET_TX_MAXSEGS,
+	.dma_attr_granular		= 1,
+	.dma_attr_flags			= 0
+};
+
+
+/*
+ * Find the register set of BAR 'bar' in the "reg" property.
+ * Returns -1 if there is none.
+ */
+static int
+virtio_bar_regnum(dev_info_t *dip, uint8_t bar)
+{
+	pci_regspec_t		*regs;
+	uint_t			nregs;
+	int			rnum = -1;
+
+	if (ddi_prop_lookup_int_array(DDI_DEV_T_ANY, dip, DDI_PROP_DONTPASS,
+	    "reg", (int **)&regs, &nregs) != DDI_PROP_SUCCESS) {
+		return (-1);
+	}
+
+	nregs = nregs * sizeof (int) / sizeof (pci_regspec_t);
+	for (uint_t i = 0; i < nregs; i++) {
+		if (PCI_REG_REG_G(regs[i].pci_phys_hi) ==
+		    PCI_CONF_BASE0 + bar * sizeof (uint32_t)) {
+			rnum = i;
+			break;
+		}
+	}
+
+	ddi_prop_free(regs);
+	return (rnum);
+}
+
+
+/*
+ * Find the vendor capability describing the modern configuration
+ * structure of type 'type'. Returns its offset in the PCI configuration
+ * space, 0 if there is none.
+ */
+static uint8_t
+virtio_modern_cap(ddi_acc_handle_t pcihdl, uint8_t type)
+{
+	uint8_t			cap;
+
+	if (!(pci_config_get16(pcihdl, PCI_CONF_STAT) & PCI_STAT_CAP)) {
+		return (0);
+	}
+
+	cap = pci_config_get8(pcihdl, PCI_CONF_CAP_PTR);
+	while (cap != PCI_CAP_NEXT_PTR_NULL) {
+		if ((pci_config_get8(pcihdl, cap + PCI_CAP_ID) ==
+		    PCI_CAP_ID_VS) && (pci_config_get8(pcihdl,
+		    cap + VIRTIO_PCI_CAP_CFG_TYPE) == type)) {
+			return (cap);
+		}
+		cap = pci_config_get8(pcihdl, cap + PCI_CAP_NEXT_PTR);
+	}
+
+	return (0);
+}
+
+
+/* Map the structure the vendor capability at 'cap' points to */
+static int
+virtio_modern_map(virtionet_state_t *sp, ddi_acc_handle_t pcihdl,
+    uint8_t cap, caddr_t *addrp, ddi_acc_handle_t *hdlp)
+{
+	int			rnum;
+
+	rnum = virtio_bar_regnum(sp->dip,
+	    pci_config_get8(pcihdl, cap + VIRTIO_PCI_CAP_BAR));
+	if (rnum < 0) {
+		return (DDI_FAILURE);
+	}
+
+	return (ddi_regs_map_setup(sp->dip, rnum, addrp,
+	    pci_config_get32(pcihdl, cap + VIRTIO_PCI_CAP_OFFSET),
+	    pci_config_get32(pcihdl, cap + VIRTIO_PCI_CAP_LENGTH),
+	    &virtio_devattr, hdlp));
+}
+
+
+/*
+ * Map the device registers. A modern device spreads its configuration
+ * structures over the BARs as its vendor capabilities say, the legacy
+ * interface has everything in the first BAR, the device specific
+ * configuration following the PCI header.
+ * Devices offering both are driven through the modern interface.
+ */
+static int
+virtio_regs_setup(virtionet_state_t *sp)
+{
+	ddi_acc_handle_t	pcihdl;
+	uint8_t			common, notify, isr, device;
+
+	if (pci_config_setup(sp->dip, &pcihdl) != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	common = virtio_modern_cap(pcihdl, VIRTIO_PCI_CAP_COMMON_CFG);
+	notify = virtio_modern_cap(pcihdl, VIRTIO_PCI_CAP_NOTIFY_CFG);
+	isr = virtio_modern_cap(pcihdl, VIRTIO_PCI_CAP_ISR_CFG);
+	device = virtio_modern_cap(pcihdl, VIRTIO_PCI_CAP_DEVICE_CFG);
+
+	sp->modern = (common != 0) && (notify != 0) && (isr != 0) &&
+	    (device != 0);
+	if (!sp->modern) {
+		pci_config_teardown(&pcihdl);
+		if (ddi_regs_map_setup(sp->dip, 1, &sp->hdraddr, 0, 0,
+		    &virtio_devattr, &sp->hdrhandle) != DDI_SUCCESS) {
+			return (DDI_FAILURE);
+		}
+		sp->devhandle = sp->hdrhandle;
+		sp->devaddr = sp->hdraddr + VIRTIO_DEVICE_SPECIFIC;
+		return (DDI_SUCCESS);
+	}
+
+	sp->notify_mult = pci_config_get32(pcihdl,
+	    notify + VIRTIO_PCI_CAP_NOTIFY_MULT);
+
+	if (virtio_modern_map(sp, pcihdl, common, &sp->hdraddr,
+	    &sp->hdrhandle) != DDI_SUCCESS) {
+		goto fail;
+	}
+	if (virtio_modern_map(sp, pcihdl, notify, &sp->notifyaddr,
+	    &sp->notifyhandle) != DDI_SUCCESS) {
+		goto fail_common;
+	}
+	if (virtio_modern_map(sp, pcihdl, isr, &sp->israddr,
+	    &sp->isrhandle) != DDI_SUCCESS) {
+		goto fail_notify;
+	}
+	if (virtio_modern_map(sp, pcihdl, device, &sp->devaddr,
+	    &sp->devhandle) != DDI_SUCCESS) {
+		goto fail_isr;
+	}
+
+	pci_config_teardown(&pcihdl);
+	return (DDI_SUCCESS);
+
+fail_isr:
+	ddi_regs_map_free(&sp->isrhandle);
+fail_notify:
+	ddi_regs_map_free(&sp->notifyhandle);
+fail_common:
+	ddi_regs_map_free(&sp->hdrhandle);
+fail:
+	pci_config_teardown(&pcihdl);
+	return (DDI_FAILURE);
+}
+
+
+static void
+virtio_regs_teardown(virtionet_state_t *sp)
+{
+	if (sp->modern) {
+		ddi_regs_map_free(&sp->devhandle);
+		ddi_regs_map_free(&sp->isrhandle);
+		ddi_regs_map_free(&sp->notifyhandle);
+	}
+	ddi_regs_map_free(&sp->hdrhandle);
+}
+
+
+static virtqueue_t *
+virtio_vq_setup(virtionet_state_t *sp, int queue, uint16_t size)
+{
+	virtqueue_t		*vqp = NULL;
+	ddi_dma_attr_t		attr;
+	size_t			len;
+	size_t			desc_size;
+	size_t			avail_size;
+	size_t			used_size;
+	size_t			part1;
+	size_t			part2;
+	int			rc;
+
+	vqp = kmem_zalloc(sizeof (*vqp), KM_SLEEP);
+
+	/* save the queue number */
+	vqp->vq_num = queue;
+
+	/* Get the queue size, only the modern transport can take less */
+	VIRTIO_PUT16(sp, VIRTIO_REG(sp, QUEUE_SELECT), queue);
+	vqp->vq_max_size = VIRTIO_GET16(sp, VIRTIO_REG(sp, QUEUE_SIZE));
+	vqp->vq_size = vqp->vq_max_size;
+	if (sp->modern && (size != 0) && (size < vqp->vq_max_size)) {
+		vqp->vq_size = size;
+		VIRTIO_PUT16(sp, VIRTIO_COMMON_QUEUE_SIZE, size);
+	}
+	vqp->vq_packed = (sp->features & VIRTIO_F_RING_PACKED) ?
+	    B_TRUE : B_FALSE;
+
+	if (vqp->vq_packed) {
+		/* Descriptor ring, then the driver and device event areas */
+		desc_size = VRING_PACKED_DTABLE_SIZE(vqp->vq_size);
+		part1 = desc_size + 2 * sizeof (vring_packed_event_t);
+		len = VRING_ROUNDUP(part1);
+	} else {
+		desc_size = VRING_DTABLE_SIZE(vqp->vq_size);
+		avail_size = VRING_AVAIL_SIZE(vqp->vq_size);
+		used_size = VRING_USED_SIZE(vqp->vq_size);
+
+		part1 = VRING_ROUNDUP(desc_size + avail_size);
+		part2 = VRING_ROUNDUP(used_size);
+
+		len = part1 + part2;
+	}
+
+	vq_dma_attr.dma_attr_flags |= DDI_DMA_FORCE_PHYSICAL;
+
+	/* The modern transport takes full 64 bit ring addresses */
+	attr = vq_dma_attr;
+	if (!sp->modern) {
+		attr.dma_attr_addr_hi = VIRTIO_VQ_LEGACY_ADDR_HI;
+	}
+
+	rc = ddi_dma_alloc_handle(sp->dip, &attr, DDI_DMA_SLEEP,
+	    NULL, &vqp->vq_dma.hdl);
+
+	if (rc == DDI_DMA_BADATTR) {
+		cmn_err(CE_NOTE, "Failed to allocate physical DMA; "
+		    "failing back to virtual DMA");
+		vq_dma_attr.dma_attr_flags &= (~DDI_DMA_FORCE_PHYSICAL);
+		attr.dma_attr_flags = vq_dma_attr.dma_attr_flags;
+		rc = ddi_dma_alloc_handle(sp->dip, &attr, DDI_DMA_SLEEP,
+		    NULL, &vqp->vq_dma.hdl);
+	}
+
+	if (rc != DDI_SUCCESS) {
+		kmem_free(vqp, sizeof (*vqp));
+		return (NULL);
+	}
+
+	rc = ddi_dma_mem_alloc(vqp->vq_dma.hdl, len, &virtio_native_attr,
+	    DDI_DMA_CONSISTENT, DDI_DMA_SLEEP, NULL, &vqp->vq_dma.addr,
+	    &vqp->vq_dma.len, &vqp->vq_dma.acchdl);
+	if (rc != DDI_SUCCESS) {
+		ddi_dma_free_handle(&vqp->vq_dma.hdl);
+		kmem_free(vqp, sizeof (*vqp));
+		return (NULL);
+	}
+
+	bzero(vqp->vq_dma.addr, vqp->vq_dma.len);
+
+	rc = ddi_dma_addr_bind_handle(vqp->vq_dma.hdl, NULL, vqp->vq_dma.addr,
+	    vqp->vq_dma.len, DDI_DMA_RDWR | DDI_DMA_CONSISTENT, DDI_DMA_SLEEP,
+	    NULL, &vqp->vq_dma.cookie, &vqp->vq_dma.ccount);
+	if (rc != DDI_DMA_MAPPED) {
+		ddi_dma_mem_free(&vqp->vq_dma.acchdl);
+		ddi_dma_free_handle(&vqp->vq_dma.hdl);
+		kmem_free(vqp, sizeof (*vqp));
+		return (NULL);
+	}
+	ASSERT(vqp->vq_dma.ccount == 1);
+
+	if (vqp->vq_packed) {
+		vqp->vr_pdesc = (vring_packed_desc_t *)vqp->vq_dma.addr;
+		vqp->vq_avail_off = desc_size;
+		vqp->vq_used_off = desc_size + sizeof (vring_packed_event_t);
+		vqp->vr_drv_event = (vring_packed_event_t *)
+		    (vqp->vq_dma.addr + vqp->vq_avail_off);
+		vqp->vr_dev_event = (vring_packed_event_t *)
+		    (vqp->vq_dma.addr + vqp->vq_used_off);
+		vqp->vr_desc = kmem_zalloc(VRING_DTABLE_SIZE(vqp->vq_size),
+		    KM_SLEEP);
+		vqp->vq_chainlen = kmem_zalloc(vqp->vq_size *
+		    sizeof (uint16_t), KM_SLEEP);
+		vqp->vq_avail_pos = vqp->vq_used_pos = 0;
+		vqp->vq_avail_wrap = vqp->vq_used_wrap = 1;
+	} else {
+		vqp->vr_desc = (vring_desc_t *)vqp->vq_dma.addr;
+		vqp->vr_avail = (vring_avail_t *)(vqp->vq_dma.addr + desc_size);
+		vqp->vr_used = (vring_used_t *)(vqp->vq_dma.addr + part1);
+		vqp->vq_avail_off = desc_size;
+		vqp->vq_used_off = part1;
+	}
+
+	/* Chain all descriptors into the free list */
+	for (int i = 0; i < vqp->vq_size; i++) {
+		vqp->vr_desc[i].next = i + 1;
+	}
+	vqp->vq_free_head = 0;
+	vqp->vq_nfree = vqp->vq_size;
+	vqp->vq_last_used = 0;
+	vqp->vq_used_idx = 0;
+	vqp->vq_avail_idx = 0;
+	vqp->vq_npushed = 0;
+	vqp->vq_nadded = 0;
+	vqp->vq_avail_flags = 0;
+	vqp->vq_kick_idx = 0;
+	vqp->vq_event_idx = (sp->features & VIRTIO_F_RING_EVENT_IDX) ?
+	    B_TRUE : B_FALSE;
+
+	return (vqp);
+}
+
+
+/*
+ * Give the ring to the device, once its MSI-X vector is set. The legacy
+ * transport only takes the page number of a split ring,
+ * VIRTIO_F_RING_PACKED is never negotiated over it. The modern one has
+ * the three ring parts programmed separately, for a packed ring the
+ * avail and used ones are the driver and device event areas.
+ */
+static void
+virtio_vq_enable(virtionet_state_t *sp, virtqueue_t *vqp)
+{
+	uint64_t		addr = vqp->vq_dma.cookie.dmac_laddress;
+	uint16_t		off;
+
+	VIRTIO_PUT16(sp, VIRTIO_REG(sp, QUEUE_SELECT), vqp->vq_num);
+
+	if (!sp->modern) {
+		VIRTIO_PUT32(sp, VIRTIO_QUEUE_ADDRESS,
+		    addr / VIRTIO_VQ_PCI_ALIGN);
+		return;
+	}
+
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_DESC, addr);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_DESC + 4, addr >> 32);
+	addr = vqp->vq_dma.cookie.dmac_laddress + vqp->vq_avail_off;
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_AVAIL, addr);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_AVAIL + 4, addr >> 32);
+	addr = vqp->vq_dma.cookie.dmac_laddress + vqp->vq_used_off;
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_USED, addr);
+	VIRTIO_PUT32(sp, VIRTIO_COMMON_QUEUE_USED + 4, addr >> 32);
+
+	off = VIRTIO_GET16(sp, VIRTIO_COMMON_QUEUE_NOTIFY_OFF);
+	vqp->vq_notify = sp->notifyaddr + off * sp->notify_mult;
+
+	VIRTIO_PUT16(sp, VIRTIO_COMMON_QUEUE_ENABLE, 1);
+}
+
+
+static void
+virtio_vq_teardown(virtionet_state_t *sp, virtqueue_t *vqp)
+{
+	if (vqp != NULL) {
+		/*
+		 * Clear the device notion of the virtqueue, a modern device
+		 * only lets go of it when reset.
+		 */
+		VIRTIO_PUT16(sp, VIRTIO_REG(sp, QUEUE_SELECT), vqp->vq_num);
+		if (!sp->modern) {
+			VIRTIO_PUT32(sp, VIRTIO_QUEUE_ADDRESS, 0);
+		}
+		if (sp->intr_type == DDI_INTR_TYPE_MSIX) {
+			VIRTIO_PUT16(sp, VIRTIO_REG(sp, MSIX_QUEUE_VECTOR),
+			    VIRTIO_MSI_NO_VECTOR);
+		}
+
+		/* Release allocated system resources */
+		if (vqp->vq_packed) {
+			kmem_free(vqp->vr_desc,
+			    VRING_DTABLE_SIZE(vqp->vq_size));
+			kmem_free(vqp->vq_chainlen,
+			    vqp->vq_size * sizeof (uint16_t));
+		}
+		(void) ddi_dma_unbind_handle(vqp->vq_dma.hdl);
+		ddi_dma_mem_free(&vqp->vq_dma.acchdl);
+		ddi_dma_free_handle(&vqp->vq_dma.hdl);
+		kmem_free(vqp, sizeof (*vqp));
+	}
+}
+
+
+static int
+virtio_fixed_intr_setup(virtionet_state_t *sp, ddi_intr_handler_t inthandler)
+{
+	int			rc;
+	int			nintr;
+	uint_t			pri;
+
+	rc = ddi_intr_get_nintrs(sp->dip, DDI_INTR_TYPE_FIXED, &nintr);
+	if (rc != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	ASSERT(nintr == 1);
+
+	rc = ddi_intr_alloc(sp->dip, sp->ihandles, DDI_INTR_TYPE_FIXED, 0, 1,
+	    &nintr, DDI_INTR_ALLOC_NORMAL);
+	if (rc != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	ASSERT(nintr == 1);
+
+	rc = ddi_intr_get_pri(sp->ihandles[0], &pri);
+	if (rc != DDI_SUCCESS) {
+		(void) ddi_intr_free(sp->ihandles[0]);
+		return (DDI_FAILURE);
+	}
+
+	/* Test for high level mutex */
+	sp->intr_pri = pri;
+	if (pri >= ddi_intr_get_hilevel_pri()) {
+		cmn_err(CE_WARN, "Hi level interrupt not supported");
+		(void) ddi_intr_free(sp->ihandles[0]);
+		return (DDI_FAILURE);
+	}
+
+	rc = ddi_intr_add_handler(sp->ihandles[0], inthandler, sp, NULL);
+	if (rc != DDI_SUCCESS) {
+		(void) ddi_intr_free(sp->ihandles[0]);
+		return (DDI_FAILURE);
+	}
+
+	sp->intr_type = DDI_INTR_TYPE_FIXED;
+	sp->intr_count = 1;
+	sp->intr_cap = 0;
+
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * Allocate an MSI-X vector for config changes and one for each Rx and Tx
+ * queue. Anything less than that and the caller falls back to FIXED.
+ */
+static int
+virtio_msix_intr_setup(virtionet_state_t *sp)
+{
+	int			nvec = VIRTIONET_MSIX_NVEC(sp->nqpairs);
+	int			rc;
+	int			nintr;
+	int			i;
+	uint_t			pri;
+
+	rc = ddi_intr_get_nintrs(sp->dip, DDI_INTR_TYPE_MSIX, &nintr);
+	if ((rc != DDI_SUCCESS) || (nintr < nvec)) {
+		return (DDI_FAILURE);
+	}
+
+	rc = ddi_intr_alloc(sp->dip, sp->ihandles, DDI_INTR_TYPE_MSIX, 0,
+	    nvec, &nintr, DDI_INTR_ALLOC_STRICT);
+	if (rc != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	ASSERT(nintr == nvec);
+
+	/* All the vectors share the same priority */
+	rc = ddi_intr_get_pri(sp->ihandles[0], &pri);
+	if ((rc != DDI_SUCCESS) || (pri >= ddi_intr_get_hilevel_pri())) {
+		i = 0;
+		goto fail;
+	}
+	sp->intr_pri = pri;
+
+	for (i = 0; i < nvec; i++) {
+		ddi_intr_handler_t	*handler;
+		caddr_t			arg;
+		uint_t			q = (i - 1) / 2;
+
+		if (i == VIRTIONET_MSIX_CFG) {
+			handler = virtionet_cfg_intr;
+			arg = (caddr_t)sp;
+		} else if (i == VIRTIONET_MSIX_RX(q)) {
+			handler = virtionet_rx_intr;
+			arg = (caddr_t)&sp->rxrings[q];
+		} else {
+			handler = virtionet_tx_intr;
+			arg = (caddr_t)&sp->txrings[q];
+		}
+		rc = ddi_intr_add_handler(sp->ihandles[i], handler, arg, NULL);
+		if (rc != DDI_SUCCESS) {
+			goto fail;
+		}
+	}
+
+	if (ddi_intr_get_cap(sp->ihandles[0], &sp->intr_cap) != DDI_SUCCESS) {
+		sp->intr_cap = 0;
+	}
+	sp->intr_type = DDI_INTR_TYPE_MSIX;
+	sp->intr_count = nvec;
+
+	return (DDI_SUCCESS);
+
+fail:
+	while (--i >= 0) {
+		(void) ddi_intr_remove_handler(sp->ihandles[i]);
+	}
+	for (i = 0; i < nvec; i++) {
+		(void) ddi_intr_free(sp->ihandles[i]);
+	}
+	return (DDI_FAILURE);
+}
+
+
+static void
+virtionet_intr_enable(virtionet_state_t *sp)
+{
+	if (sp->intr_cap & DDI_INTR_FLAG_BLOCK) {
+		(void) ddi_intr_block_enable(sp->ihandles, sp->intr_count);
+	} else {
+		for (int i = 0; i < sp->intr_count; i++) {
+			(void) ddi_intr_enable(sp->ihandles[i]);
+		}
+	}
+}
+
+
+static void
+virtionet_intr_disable(virtionet_state_t *sp)
+{
+	if (sp->intr_cap & DDI_INTR_FLAG_BLOCK) {
+		(void) ddi_intr_block_disable(sp->ihandles, sp->intr_count);
+	} else {
+		for (int i = 0; i < sp->intr_count; i++) {
+			(void) ddi_intr_disable(sp->ihandles[i]);
+		}
+	}
+}
+
+
+static int
+virtio_intr_teardown(virtionet_state_t *sp)
+{
+	virtionet_intr_disable(sp);
+	for (int i = 0; i < sp->intr_count; i++) {
+		(void) ddi_intr_remove_handler(sp->ihandles[i]);
+		(void) ddi_intr_free(sp->ihandles[i]);
+	}
+	sp->intr_count = 0;
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * kmem cache constructor of a page-sized DMA chunk. Binding the chunk
+ * here lets the cache keep it mapped while it is not in use.
+ */
+static int
+virtionet_chunk_ctor(void *buf, void *arg, int kmflags)
+{
+	virtionet_dma_t		*dmap = buf;
+	virtionet_state_t	*sp = arg;
+	ddi_dma_attr_t		attr = chunk_dma_attr;
+	int			(*waitfp)(caddr_t);
+	int			rc;
+
+	waitfp = (kmflags & KM_NOSLEEP) ? DDI_DMA_DONTWAIT : DDI_DMA_SLEEP;
+	bzero(dmap, sizeof (*dmap));
+
+	rc = ddi_dma_alloc_handle(sp->dip, &attr, waitfp, NULL, &dmap->hdl);
+	if (rc == DDI_DMA_BADATTR) {
+		/* Fall back to virtual DMA */
+		attr.dma_attr_flags &= (~DDI_DMA_FORCE_PHYSICAL);
+		rc = ddi_dma_alloc_handle(sp->dip, &attr, waitfp, NULL,
+		    &dmap->hdl);
+	}
+	if (rc != DDI_SUCCESS) {
+		return (-1);
+	}
+
+	rc = ddi_dma_mem_alloc(dmap->hdl, PAGESIZE, &virtio_native_attr,
+	    DDI_DMA_CONSISTENT, waitfp, NULL, &dmap->addr, &dmap->len,
+	    &dmap->acchdl);
+	if (rc != DDI_SUCCESS) {
+		ddi_dma_free_handle(&dmap->hdl);
+		return (-1);
+	}
+
+	rc = ddi_dma_addr_bind_handle(dmap->hdl, NULL, dmap->addr,
+	    dmap->len, DDI_DMA_RDWR | DDI_DMA_STREAMING, waitfp, NULL,
+	    &dmap->cookie, &dmap->ccount);
+	if (rc != DDI_DMA_MAPPED) {
+		ddi_dma_mem_free(&dmap->acchdl);
+		ddi_dma_free_handle(&dmap->hdl);
+		return (-1);
+	}
+	ASSERT(dmap->ccount == 1);
+
+	return (0);
+}
+
+
+static void
+virtionet_chunk_dtor(void *buf, void *arg)
+{
+	virtionet_dma_t		*dmap = buf;
+
+	(void) ddi_dma_unbind_handle(dmap->hdl);
+	ddi_dma_mem_free(&dmap->acchdl);
+	ddi_dma_free_handle(&dmap->hdl);
+}
+
+
+static void
+virtionet_pool_destroy(virtionet_state_t *sp, virtionet_pool_t *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+
+	for (uint_t i = 0; i < pool->vp_nchunks; i++) {
+		if (pool->vp_chunks[i] != NULL) {
+			kmem_cache_free(sp->chunk_cache, pool->vp_chunks[i]);
+		}
+	}
+	kmem_free(pool->vp_chunks,
+	    pool->vp_nchunks * sizeof (virtionet_dma_t *));
+	kmem_free(pool->vp_bufs, pool->vp_nbufs * sizeof (virtionet_buf_t));
+	kmem_free(pool, sizeof (*pool));
+}
+
+
+/*
+ * Carve 'nbufs' zeroed buffers of 'bufsize' bytes, at most a page, out of
+ * as many chunks as it takes. Every buffer starts on a cache line.
+ */
+static virtionet_pool_t *
+virtionet_pool_create(virtionet_state_t *sp, uint_t nbufs, size_t bufsize)
+{
+	virtionet_pool_t	*pool;
+	virtionet_dma_t		*dmap;
+	virtionet_buf_t		*bp;
+	size_t			stride;
+	uint_t			perchunk;
+
+	ASSERT(bufsize <= PAGESIZE);
+
+	stride = P2ROUNDUP(bufsize, VIRTIONET_CACHE_LINE);
+	perchunk = PAGESIZE / stride;
+
+	pool = kmem_zalloc(sizeof (*pool), KM_SLEEP);
+	pool->vp_bufsize = bufsize;
+	pool->vp_nbufs = nbufs;
+	pool->vp_bufs = kmem_zalloc(nbufs * sizeof (virtionet_buf_t), KM_SLEEP);
+	pool->vp_nchunks = howmany(nbufs, perchunk);
+	pool->vp_chunks = kmem_zalloc(pool->vp_nchunks *
+	    sizeof (virtionet_dma_t *), KM_SLEEP);
+
+	for (uint_t i = 0; i < pool->vp_nchunks; i++) {
+		dmap = kmem_cache_alloc(sp->chunk_cache, KM_SLEEP);
+		if (dmap == NULL) {
+			/* The constructor failed */
+			virtionet_pool_destroy(sp, pool);
+			return (NULL);
+		}
+		pool->vp_chunks[i] = dmap;
+
+		/* Chunks come back from the cache as they were left */
+		bzero(dmap->addr, dmap->len);
+	}
+
+	for (uint_t i = 0; i < nbufs; i++) {
+		dmap = pool->vp_chunks[i / perchunk];
+		bp = &pool->vp_bufs[i];
+		bp->vb_off = (i % perchunk) * stride;
+		bp->vb_addr = dmap->addr + bp->vb_off;
+		bp->vb_paddr = dmap->cookie.dmac_laddress + bp->vb_off;
+		bp->vb_hdl = dmap->hdl;
+	}
+
+	return (pool);
+}
+
+
+/*
+ * Work out the Rx buffer size and the number of buffers in a slot for the
+ * given MTU. Normally every Rx slot is a single buffer for one frame.
+ * Frames too large for that, jumbo ones or 64 KB ones when the host may
+ * coalesce TCP segments (GUEST_TSO), need a chain of page-sized buffers
+ * per slot, unless mergeable Rx buffers let a frame span several single
+ * buffer slots instead.
+ */
+static void
+virtionet_rx_layout(virtionet_state_t *sp, uint32_t mtu, size_t *bufsizep,
+    uint_t *slotbufsp)
+{
+	size_t			maxframe;
+
+	if (sp->features &
+	    (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)) {
+		maxframe = VIRTIONET_LRO_MAXLEN;
+	} else {
+		maxframe = mtu + sizeof (struct ether_vlan_header);
+	}
+
+	if (sp->hdrlen + maxframe <= VIRTIONET_BUFSZ) {
+		*bufsizep = VIRTIONET_BUFSZ;
+		*slotbufsp = 1;
+	} else if (sp->features & VIRTIO_NET_F_MRG_RXBUF) {
+		*bufsizep = PAGESIZE;
+		*slotbufsp = 1;
+	} else {
+		*bufsizep = PAGESIZE;
+		*slotbufsp = howmany(sp->hdrlen + maxframe, PAGESIZE);
+	}
+}
+
+
+/*
+ * Allocate the Rx buffers: the ones posted on the ring, no more than the
+ * requested Rx queue size takes, plus the spares replacing the ones
+ * loaned up the stack. Multi-buffer slots use an
+ * indirect table if possible.
+ */
+static int
+virtionet_rx_setup(virtionet_rxring_t *rxr)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+	virtionet_rxbuf_t	*rbp;
+	uint_t			n = rxr->rr_vq->vq_size;
+	uint_t			ndesc = virtionet_rx_qsize(sp, rxr->rr_vq);
+	uint_t			nposted;
+
+	if (sp->rx_slotbufs == 1) {
+		rxr->rr_nslots = ndesc;
+	} else if (sp->features & VIRTIO_F_RING_INDIRECT_DESC) {
+		/* 64 KB slots take a lot of memory, post fewer of them */
+		if (sp->features &
+		    (VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6)) {
+			rxr->rr_nslots = MIN(ndesc, virtionet_rx_lro_slots);
+		} else {
+			rxr->rr_nslots = ndesc;
+		}
+		rxr->rr_ind = virtionet_pool_create(sp, n,
+		    sp->rx_slotbufs * sizeof (vring_desc_t));
+		if (rxr->rr_ind == NULL) {
+			return (DDI_FAILURE);
+		}
+	} else {
+		rxr->rr_nslots = ndesc / sp->rx_slotbufs;
+	}
+
+	nposted = rxr->rr_nslots * sp->rx_slotbufs;
+	rxr->rr_nbufs = nposted + nposted * virtionet_rx_spare_ratio;
+	rxr->rr_bufs = kmem_zalloc(rxr->rr_nbufs * sizeof (virtionet_rxbuf_t),
+	    KM_SLEEP);
+	rxr->rr_slots = kmem_zalloc(n * sp->rx_slotbufs *
+	    sizeof (virtionet_rxbuf_t *), KM_SLEEP);
+	rxr->rr_free = rxr->rr_recycle = NULL;
+
+	rxr->rr_pool = virtionet_pool_create(sp, rxr->rr_nbufs, sp->rx_bufsize);
+	if (rxr->rr_pool == NULL) {
+		return (DDI_FAILURE);
+	}
+
+	for (uint_t i = 0; i < rxr->rr_nbufs; i++) {
+		rbp = &rxr->rr_bufs[i];
+		rbp->rb_buf = &rxr->rr_pool->vp_bufs[i];
+		rbp->rb_rxr = rxr;
+		rbp->rb_frtn.free_func = virtionet_rxbuf_free;
+		rbp->rb_frtn.free_arg = (caddr_t)rbp;
+
+		/* The first ones are assigned to the slots when posted */
+		if (i >= nposted) {
+			rbp->rb_next = rxr->rr_free;
+			rxr->rr_free = rbp;
+		}
+	}
+
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * The caller must make sure no Rx buffers are loaned. rr_vq is already
+ * cleared, 'qsize' is the size of the queue the slots were for.
+ */
+static void
+virtionet_rx_teardown(virtionet_rxring_t *rxr, uint16_t qsize)
+{
+	virtionet_state_t	*sp = rxr->rr_sp;
+
+	ASSERT(sp->rx_nloaned == 0);
+
+	if (rxr->rr_slots != NULL) {
+		kmem_free(rxr->rr_slots, qsize * sp->rx_slotbufs *
+		    sizeof (virtionet_rxbuf_t *));
+		rxr->rr_slots = NULL;
+	}
+
+	if (rxr->rr_bufs != NULL) {
+		kmem_free(rxr->rr_bufs,
+		    rxr->rr_nbufs * sizeof (virtionet_rxbuf_t));
+		rxr->rr_bufs = NULL;
+		rxr->rr_nbufs = 0;
+	}
+
+	virtionet_pool_destroy(sp, rxr->rr_pool);
+	virtionet_pool_destroy(sp, rxr->rr_ind);
+	rxr->rr_pool = rxr->rr_ind = NULL;
+	rxr->rr_free = rxr->rr_recycle = NULL;
+}
+
+
+/*
+ * Allocate the Tx copy slots, the slot array and the pool of DMA handles
+ * used for binding. Tx frames that do not fit a slot, jumbo and LSO ones,
+ * are always bound, so the slot size doesn't follow the MTU. There is one
+ * handle per descriptor. That is enough for direct descriptors, but an
+ * indirect slot holds up to VIRTIONET_TX_MAXSEGS fragments, so the
+ * handles may run out before the ring does. virtionet_send_bind() then
+ * blocks the ring like a full one rather than dropping the packet.
+ */
+static int
+virtionet_tx_setup(virtionet_txring_t *txr)
+{
+	virtionet_state_t	*sp = txr->tr_sp;
+	virtionet_txdmah_t	*dhp;
+	uint_t			n = txr->tr_vq->vq_size;
+	int			rc;
+
+	txr->tr_buf = virtionet_pool_create(sp, n, VIRTIONET_BUFSZ);
+	if (txr->tr_buf == NULL) {
+		return (DDI_FAILURE);
+	}
+
+	/* One indirect table for every Tx slot */
+	if (sp->features & VIRTIO_F_RING_INDIRECT_DESC) {
+		txr->tr_ind = virtionet_pool_create(sp, n,
+		    VIRTIONET_TX_INDIRECT_SIZE);
+		if (txr->tr_ind == NULL) {
+			return (DDI_FAILURE);
+		}
+	}
+
+	txr->tr_slots = kmem_zalloc(n * sizeof (virtionet_txslot_t), KM_SLEEP);
+	txr->tr_dmah = kmem_zalloc(n * sizeof (virtionet_txdmah_t), KM_SLEEP);
+	txr->tr_dmah_free = NULL;
+
+	for (txr->tr_ndmah = 0; txr->tr_ndmah < n; txr->tr_ndmah++) {
+		dhp = &txr->tr_dmah[txr->tr_ndmah];
+		rc = ddi_dma_alloc_handle(sp->dip, &tx_dma_attr, DDI_DMA_SLEEP,
+		    NULL, &dhp->hdl);
+		if (rc != DDI_SUCCESS) {
+			return (DDI_FAILURE);
+		}
+		dhp->next = txr->tr_dmah_free;
+		txr->tr_dmah_free = dhp;
+	}
+
+	return (DDI_SUCCESS);
+}
+
+
+static void
+virtionet_tx_teardown(virtionet_txring_t *txr)
+{
+	virtionet_state_t	*sp = txr->tr_sp;
+	virtionet_txslot_t	*tsp;
+	uint_t			n;
+
+	if (txr->tr_slots != NULL) {
+		/* Free whatever the device didn't complete */
+		n = txr->tr_vq->vq_size;
+		for (tsp = txr->tr_slots; tsp < txr->tr_slots + n; tsp++) {
+			if (tsp->ts_mp != NULL) {
+				virtionet_tx_unbind(txr, tsp->ts_dmah);
+				freemsg(tsp->ts_mp);
+			}
+		}
+		kmem_free(txr->tr_slots, n * sizeof (virtionet_txslot_t));
+		txr->tr_slots = NULL;
+	}
 
-	VIRTIO_PUT32(sp, VIRTIO_QUEUE_ADDRESS,
-	    vqp->vq_dma.cookie.dmac_address / VIRTIO_VQ_PCI_ALIGN);
+	if (txr->tr_dmah != NULL) {
+		for (uint_t i = 0; i < txr->tr_ndmah; i++) {
+			ddi_dma_free_handle(&txr->tr_dmah[i].hdl);
+		}
+		kmem_free(txr->tr_dmah,
+		    txr->tr_vq->vq_size * sizeof (virtionet_txdmah_t));
+		txr->tr_dmah = txr->tr_dmah_free = NULL;
+		txr->tr_ndmah = 0;
+	}
 
-	return (vqp);
+	virtionet_pool_destroy(sp, txr->tr_buf);
+	virtionet_pool_destroy(sp, txr->tr_ind);
+	txr->tr_buf = txr->tr_ind = NULL;
 }
 
 
 static void
-virtio_vq_teardown(virtionet_state_t *sp, virtqueue_t *vqp)
+virtionet_vq_teardown(virtionet_state_t *sp)
 {
-	if (vqp != NULL) {
-		/* Clear the device notion of the virtqueue */
-		VIRTIO_PUT16(sp, VIRTIO_QUEUE_SELECT, vqp->vq_num);
-		VIRTIO_PUT32(sp, VIRTIO_QUEUE_ADDRESS, 0);
+	/* Nothing may run the rings past this */
+	virtionet_imod_stop(sp);
 
-		/* Release allocated system resources */
-		(void) ddi_dma_unbind_handle(vqp->vq_dma.hdl);
-		ddi_dma_mem_free(&vqp->vq_dma.acchdl);
-		ddi_dma_free_handle(&vqp->vq_dma.hdl);
-		kmem_free(vqp, sizeof (*vqp));
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		virtionet_rxring_t	*rxr = &sp->rxrings[i];
+		virtionet_txring_t	*txr = &sp->txrings[i];
+		virtqueue_t		*rvqp = rxr->rr_vq;
+
+		/* A pending Rx softint finds the queue gone once it locks */
+		mutex_enter(&rxr->rr_lock);
+		rxr->rr_vq = NULL;
+		mutex_exit(&rxr->rr_lock);
+
+		if (rvqp != NULL) {
+			virtionet_rx_teardown(rxr, rvqp->vq_size);
+		}
+		if (txr->tr_vq != NULL) {
+			virtionet_tx_teardown(txr);
+		}
+		virtio_vq_teardown(sp, rvqp);
+		virtio_vq_teardown(sp, txr->tr_vq);
+		txr->tr_vq = NULL;
 	}
+	virtionet_pool_destroy(sp, sp->ctlbuf);
+	sp->ctlbuf = NULL;
+	virtio_vq_teardown(sp, sp->ctlq);
+	sp->ctlq = NULL;
 }
 
 
+/*
+ * Point the device at the MSI-X vector of every queue and of config
+ * changes. The device answers VIRTIO_MSI_NO_VECTOR if it can't use one.
+ */
 static int
-virtio_fixed_intr_setup(virtionet_state_t *sp, ddi_intr_handler_t inthandler)
+virtionet_msix_route_vq(virtionet_state_t *sp, virtqueue_t *vqp,
+    uint16_t vec)
 {
-	int			rc;
-	int			nintr;
-	uint_t			pri;
-
-	rc = ddi_intr_get_nintrs(sp->dip, DDI_INTR_TYPE_FIXED, &nintr);
-	if (rc != DDI_SUCCESS) {
+	VIRTIO_PUT16(sp, VIRTIO_REG(sp, QUEUE_SELECT), vqp->vq_num);
+	VIRTIO_PUT16(sp, VIRTIO_REG(sp, MSIX_QUEUE_VECTOR), vec);
+	if (VIRTIO_GET16(sp, VIRTIO_REG(sp, MSIX_QUEUE_VECTOR)) != vec) {
 		return (DDI_FAILURE);
 	}
+	return (DDI_SUCCESS);
+}
 
-	ASSERT(nintr == 1);
 
-	rc = ddi_intr_alloc(sp->dip, &sp->ihandle, DDI_INTR_TYPE_FIXED, 0, 1,
-	    &nintr, DDI_INTR_ALLOC_NORMAL);
-	if (rc != DDI_SUCCESS) {
+static int
+virtionet_msix_route(virtionet_state_t *sp)
+{
+	if (sp->intr_type != DDI_INTR_TYPE_MSIX) {
+		return (DDI_SUCCESS);
+	}
+
+	VIRTIO_PUT16(sp, VIRTIO_REG(sp, MSIX_CONFIG_VECTOR),
+	    VIRTIONET_MSIX_CFG);
+	if (VIRTIO_GET16(sp, VIRTIO_REG(sp, MSIX_CONFIG_VECTOR)) !=
+	    VIRTIONET_MSIX_CFG) {
 		return (DDI_FAILURE);
 	}
 
-	ASSERT(nintr == 1);
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		if ((virtionet_msix_route_vq(sp, sp->rxrings[i].rr_vq,
+		    VIRTIONET_MSIX_RX(i)) != DDI_SUCCESS) ||
+		    (virtionet_msix_route_vq(sp, sp->txrings[i].tr_vq,
+		    VIRTIONET_MSIX_TX(i)) != DDI_SUCCESS)) {
+			return (DDI_FAILURE);
+		}
+	}
 
-	rc = ddi_intr_get_pri(sp->ihandle, &pri);
-	if (rc != DDI_SUCCESS) {
-		(void) ddi_intr_free(sp->ihandle);
+	/* Control commands are polled, the vector is never really used */
+	if ((sp->ctlq != NULL) && (virtionet_msix_route_vq(sp, sp->ctlq,
+	    VIRTIONET_MSIX_CFG) != DDI_SUCCESS)) {
 		return (DDI_FAILURE);
 	}
 
-	/* Test for high level mutex */
-	if (pri >= ddi_intr_get_hilevel_pri()) {
-		cmn_err(CE_WARN, "Hi level interrupt not supported");
-		(void) ddi_intr_free(sp->ihandle);
-		return (DDI_FAILURE);
+	return (DDI_SUCCESS);
+}
+
+
+/*
+ * Set up the queues. Rx queue N is virtqueue 2N and Tx queue N is
+ * virtqueue 2N + 1, the control queue comes after all the pairs the
+ * device offers, used or not.
+ */
+static int
+virtionet_vq_setup(virtionet_state_t *sp)
+{
+	boolean_t		failed = B_FALSE;
+
+	virtionet_imod_start(sp);
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		sp->rxrings[i].rr_vq = virtio_vq_setup(sp, 2 * i, sp->rxq_size);
+		sp->txrings[i].tr_vq = virtio_vq_setup(sp, 2 * i + 1,
+		    sp->txq_size);
+		if ((sp->rxrings[i].rr_vq == NULL) ||
+		    (sp->txrings[i].tr_vq == NULL)) {
+			failed = B_TRUE;
+		}
 	}
 
-	rc = ddi_intr_add_handler(sp->ihandle, inthandler, sp, NULL);
-	if (rc != DDI_SUCCESS) {
-		(void) ddi_intr_free(sp->ihandle);
-		return (DDI_FAILURE);
+	if (sp->features & VIRTIO_NET_F_CTRL_VQ) {
+		sp->ctlq = virtio_vq_setup(sp, 2 * sp->max_qpairs,
+		    sp->ctlq_size);
+		if (sp->ctlq == NULL) {
+			failed = B_TRUE;
+		}
 	}
 
-	rc = ddi_intr_enable(sp->ihandle);
-	if (rc != DDI_SUCCESS) {
-		(void) ddi_intr_remove_handler(sp->ihandle);
-		(void) ddi_intr_free(sp->ihandle);
+	/* The device must forget the rings before they are freed */
+	if (failed || (virtionet_msix_route(sp) != DDI_SUCCESS)) {
+		VIRTIO_DEV_RESET(sp);
+		virtionet_vq_teardown(sp);
 		return (DDI_FAILURE);
 	}
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		virtio_vq_enable(sp, sp->rxrings[i].rr_vq);
+		virtio_vq_enable(sp, sp->txrings[i].tr_vq);
+	}
+	if (sp->ctlq != NULL) {
+		virtio_vq_enable(sp, sp->ctlq);
+	}
+
+	/* Only the commands in flight need a buffer, not every descriptor */
+	if (sp->ctlq != NULL) {
+		sp->ctlbuf = virtionet_pool_create(sp, VIRTIONET_CTRL_NBUFS,
+		    VIRTIONET_CTRL_BUFSZ);
+		if (sp->ctlbuf == NULL) {
+			VIRTIO_DEV_RESET(sp);
+			virtionet_vq_teardown(sp);
+			return (DDI_FAILURE);
+		}
+		for (uint_t i = 0; i < VIRTIONET_CTRL_NBUFS; i++) {
+			sp->ctl_heads[i] = VIRTIONET_CTRL_FREE;
+		}
+	}
+
+	virtionet_rx_layout(sp, sp->mtu, &sp->rx_bufsize, &sp->rx_slotbufs);
+	ASSERT(sp->rx_slotbufs <= VIRTIONET_RX_MAXFRAGS);
+
+	/*
+	 * The longer mergeable Rx buffers header would leave the IP header
+	 * misaligned, so the buffers are posted at an offset.
+	 */
+	sp->rx_bufoff = 0;
+	if (sp->hdrlen == sizeof (virtio_net_hdr_rxbuf_t)) {
+		sp->rx_bufoff = P2NPHASE(sp->hdrlen +
+		    sizeof (struct ether_header), sizeof (uint32_t));
+	}
+	sp->rx_nloaned = 0;
+
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		if ((virtionet_rx_setup(&sp->rxrings[i]) != DDI_SUCCESS) ||
+		    (virtionet_tx_setup(&sp->txrings[i]) != DDI_SUCCESS)) {
+			VIRTIO_DEV_RESET(sp);
+			virtionet_vq_teardown(sp);
+			return (DDI_FAILURE);
+		}
+
+		/* Initialize virtqueue rings */
+		virtionet_rx_post(&sp->rxrings[i]);
+	}
+
 	return (DDI_SUCCESS);
 }
 
 
+/*
+ * Replace all the virtqueue buffers. Only a device reset makes it give up
+ * the posted Rx buffers, so the device goes through the whole
+ * initialization again and is left for virtionet_start() to enable.
+ */
 static int
-virtio_intr_teardown(virtionet_state_t *sp)
+virtionet_vq_reset(virtionet_state_t *sp)
 {
-	int			rc;
+	virtionet_intr_disable(sp);
+
+	VIRTIO_DEV_RESET(sp);
+	virtionet_vq_teardown(sp);
+
+	VIRTIO_DEV_ACK(sp);
+	VIRTIO_DEV_DRIVER(sp);
+
+	if ((virtio_set_features(sp, sp->features) != DDI_SUCCESS) ||
+	    (virtionet_vq_setup(sp) != DDI_SUCCESS)) {
+		VIRTIO_DEV_FAILED(sp);
+		return (DDI_FAILURE);
+	}
+
+	virtionet_intr_enable(sp);
 
-	rc = ddi_intr_disable(sp->ihandle);
-	rc = ddi_intr_remove_handler(sp->ihandle);
-	rc = ddi_intr_free(sp->ihandle);
 	return (DDI_SUCCESS);
 }
 
 
-static virtionet_dma_t *
-virtionet_dma_setup(virtionet_state_t *sp, size_t len)
+/*
+ * Stop loaning Rx buffers ahead of a virtionet_vq_reset(), the stopped
+ * link still receives until then. Once every Rx ring lock was taken no
+ * frame in progress can loan one any more. The caller clears rx_noloan
+ * when done.
+ * Returns B_FALSE, loaning again, if the stack still holds some.
+ */
+static boolean_t
+virtionet_rx_stop_loans(virtionet_state_t *sp)
 {
-	virtionet_dma_t		*dmap;
-	int			rc;
+	sp->rx_noloan = B_TRUE;
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		mutex_enter(&sp->rxrings[i].rr_lock);
+		mutex_exit(&sp->rxrings[i].rr_lock);
+	}
 
-	dmap = kmem_zalloc(sizeof (*dmap), KM_SLEEP);
+	if (sp->rx_nloaned != 0) {
+		sp->rx_noloan = B_FALSE;
+		return (B_FALSE);
+	}
+	return (B_TRUE);
+}
 
-	vq_dma_attr.dma_attr_flags |= DDI_DMA_FORCE_PHYSICAL;
 
-	rc = ddi_dma_alloc_handle(sp->dip, &vq_dma_attr, DDI_DMA_SLEEP,
-	    NULL, &dmap->hdl);
+/*
+ * Change the MTU. The Rx buffers are resized if the new MTU needs it,
+ * which can only be done while the link is stopped and the stack holds
+ * none of them.
+ */
+static int
+virtionet_set_mtu(virtionet_state_t *sp, uint32_t mtu)
+{
+	uint32_t		omtu = sp->mtu;
+	size_t			bufsize;
+	uint_t			slotbufs;
+	boolean_t		resize;
+	int			rc;
 
-	if (rc == DDI_DMA_BADATTR) {
-		cmn_err(CE_NOTE, "Failed to allocate physical DMA; "
-		    "failing back to virtual DMA");
-		vq_dma_attr.dma_attr_flags &= (~DDI_DMA_FORCE_PHYSICAL);
-		rc = ddi_dma_alloc_handle(sp->dip, &vq_dma_attr, DDI_DMA_SLEEP,
-		    NULL, &dmap->hdl);
+	if ((mtu < ETHERMIN) || (mtu > sp->max_mtu)) {
+		return (EINVAL);
 	}
-
-	if (rc != DDI_SUCCESS) {
-		kmem_free(dmap, sizeof (*dmap));
-		return (NULL);
+	if (mtu == sp->mtu) {
+		return (0);
 	}
 
-	rc = ddi_dma_mem_alloc(dmap->hdl, len, &virtio_native_attr,
-	    DDI_DMA_CONSISTENT, DDI_DMA_SLEEP, NULL, &dmap->addr,
-	    &dmap->len, &dmap->acchdl);
-	if (rc != DDI_SUCCESS) {
-		ddi_dma_free_handle(&dmap->hdl);
-		kmem_free(dmap, sizeof (*dmap));
-		return (NULL);
+	virtionet_rx_layout(sp, mtu, &bufsize, &slotbufs);
+	resize = (bufsize != sp->rx_bufsize) || (slotbufs != sp->rx_slotbufs);
+	if (resize && (sp->started || !virtionet_rx_stop_loans(sp))) {
+		return (EBUSY);
 	}
 
-	bzero(dmap->addr, dmap->len);
+	rc = mac_maxsdu_update(sp->mh, mtu);
+	if (rc != 0) {
+		sp->rx_noloan = B_FALSE;
+		return (rc);
+	}
+	sp->mtu = mtu;
 
-	rc = ddi_dma_addr_bind_handle(dmap->hdl, NULL, dmap->addr,
-	    dmap->len, DDI_DMA_RDWR | DDI_DMA_STREAMING, DDI_DMA_SLEEP,
-	    NULL, &dmap->cookie, &dmap->ccount);
-	if (rc != DDI_DMA_MAPPED) {
-		ddi_dma_mem_free(&dmap->acchdl);
-		ddi_dma_free_handle(&dmap->hdl);
-		kmem_free(dmap, sizeof (*dmap));
-		return (NULL);
+	if (resize && (virtionet_vq_reset(sp) != DDI_SUCCESS)) {
+		sp->mtu = omtu;
+		(void) mac_maxsdu_update(sp->mh, omtu);
+		if (virtionet_vq_reset(sp) != DDI_SUCCESS) {
+			cmn_err(CE_WARN, "Failed to restore virtqueues");
+		}
+		rc = ENOMEM;
 	}
-	ASSERT(dmap->ccount == 1);
 
-	return (dmap);
+	sp->rx_noloan = B_FALSE;
+	return (rc);
 }
 
 
-static void
-virtionet_dma_teardown(virtionet_dma_t *dmap)
+/*
+ * Interrupt moderation properties. The queues pick them up the next time
+ * they sample their packet rate, nothing has to be restarted.
+ * Returns ENOTSUP for any other property.
+ */
+static int
+virtionet_imod_setprop(virtionet_state_t *sp, const char *pname,
+    const void *pval)
 {
-	if (dmap != NULL) {
-		/* Release allocated system resources */
-		(void) ddi_dma_unbind_handle(dmap->hdl);
-		ddi_dma_mem_free(&dmap->acchdl);
-		ddi_dma_free_handle(&dmap->hdl);
-		kmem_free(dmap, sizeof (*dmap));
+	ulong_t			val;
+
+	if (strcmp(pname, VIRTIONET_PROP_IMOD) == 0) {
+		for (uint_t i = 0; i < VIRTIONET_IMOD_NMODES; i++) {
+			if (strcmp(pval, virtionet_imod_modes[i]) == 0) {
+				sp->imod_mode = i;
+				return (0);
+			}
+		}
+		return (EINVAL);
+	}
+
+	if ((strcmp(pname, VIRTIONET_PROP_IMOD_HIGH) != 0) &&
+	    (strcmp(pname, VIRTIONET_PROP_IMOD_LOW) != 0) &&
+	    (strcmp(pname, VIRTIONET_PROP_IMOD_USEC) != 0)) {
+		return (ENOTSUP);
 	}
-}
 
+	if ((ddi_strtoul(pval, NULL, 0, &val) != 0) || (val == 0) ||
+	    ((uint32_t)val != val)) {
+		return (EINVAL);
+	}
 
-static void
-virtionet_vq_teardown(virtionet_state_t *sp)
-{
-	virtionet_dma_teardown(sp->rxbuf);
-	virtionet_dma_teardown(sp->txbuf);
-	virtionet_dma_teardown(sp->ctlbuf);
-	virtio_vq_teardown(sp, sp->rxq);
-	virtio_vq_teardown(sp, sp->txq);
-	virtio_vq_teardown(sp, sp->ctlq);
-	sp->rxq = sp->txq = sp->ctlq = NULL;
+	if (strcmp(pname, VIRTIONET_PROP_IMOD_HIGH) == 0) {
+		if (val < sp->imod_low) {
+			return (EINVAL);
+		}
+		sp->imod_high = (uint32_t)val;
+	} else if (strcmp(pname, VIRTIONET_PROP_IMOD_LOW) == 0) {
+		if (val > sp->imod_high) {
+			return (EINVAL);
+		}
+		sp->imod_low = (uint32_t)val;
+	} else {
+		if ((val < VIRTIONET_IMOD_MIN_USEC) || (val > MICROSEC)) {
+			return (EINVAL);
+		}
+		sp->imod_usec = (uint32_t)val;
+	}
+
+	return (0);
 }
 
 
+/*
+ * Private properties. Changing the size of a queue rebuilds the rings and
+ * the buffer pools, like an Rx buffer resize it needs a stopped link the
+ * stack holds no Rx buffers of.
+ */
 static int
-virtionet_vq_setup(virtionet_state_t *sp)
+virtionet_priv_setprop(virtionet_state_t *sp, const char *pname,
+    const void *pval)
 {
-	/* Receive queue */
-	sp->rxq = virtio_vq_setup(sp, 0);
-
-	/* Transmit queue */
-	sp->txq = virtio_vq_setup(sp, 1);
+	virtqueue_t		*vqp;
+	uint16_t		*sizep;
+	uint16_t		osize;
+	ulong_t			val;
+	int			rc;
 
-	/* Control queue */
-	sp->ctlq = virtio_vq_setup(sp, 2);
+	rc = virtionet_imod_setprop(sp, pname, pval);
+	if (rc != ENOTSUP) {
+		return (rc);
+	}
 
-	if ((sp->rxq == NULL) ||
-	    (sp->txq == NULL) ||
-	    (sp->ctlq == NULL)) {
-		virtionet_vq_teardown(sp);
-		return (DDI_FAILURE);
+	vqp = virtionet_qsize_vq(sp, pname, &sizep);
+	if (vqp == NULL) {
+		/* A failed queue size change may have left no queues */
+		return ((sp->rxrings[0].rr_vq == NULL) ? EIO : ENOTSUP);
 	}
 
-	/* Allocate buffers */
-	/* XXX Fix the size - needs to be aligned with the max frame size */
-	sp->rxbuf = virtionet_dma_setup(sp, sp->rxq->vq_size * 2048);
-	sp->txbuf = virtionet_dma_setup(sp, sp->txq->vq_size * 2048);
-	/* Control messages are smaller */
-	sp->ctlbuf = virtionet_dma_setup(sp, sp->ctlq->vq_size * 128);
+	if (ddi_strtoul(pval, NULL, 0, &val) != 0) {
+		return (EINVAL);
+	}
+	if (!ISP2(val) || (val < VIRTIONET_MIN_QSIZE) ||
+	    (val > vqp->vq_max_size)) {
+		return (EINVAL);
+	}
+	if (val == ((*sizep != 0) ? *sizep : vqp->vq_max_size)) {
+		return (0);
+	}
+	if (sp->started || !virtionet_rx_stop_loans(sp)) {
+		return (EBUSY);
+	}
 
-	if ((sp->rxbuf == NULL) ||
-	    (sp->txbuf == NULL) ||
-	    (sp->ctlbuf == NULL)) {
-		virtionet_vq_teardown(sp);
-		return (DDI_FAILURE);
+	rc = 0;
+	osize = *sizep;
+	*sizep = (uint16_t)val;
+	if (virtionet_vq_reset(sp) != DDI_SUCCESS) {
+		*sizep = osize;
+		if (virtionet_vq_reset(sp) != DDI_SUCCESS) {
+			cmn_err(CE_WARN, "Failed to restore virtqueues");
+		}
+		rc = ENOMEM;
 	}
 
-	/* Initialize virtqueue rings */
-	/* Rx VQ ring */
-	for (int i = 0; i < sp->rxq->vq_size; i++) {
-		sp->rxq->vr_desc[i].addr =
-		    sp->rxbuf->cookie.dmac_laddress + i * 2048;
-		sp->rxq->vr_desc[i].len = 2048;
-		sp->rxq->vr_desc[i].flags = VRING_DESC_F_WRITE;
-		sp->rxq->vr_desc[i].next = 0;
+	sp->rx_noloan = B_FALSE;
+	return (rc);
+}
+
+
+static void
+virtionet_rings_free(virtionet_state_t *sp)
+{
+	kmem_free(sp->rxrings, sp->nqpairs * sizeof (virtionet_rxring_t));
+	kmem_free(sp->txrings, sp->nqpairs * sizeof (virtionet_txring_t));
+	sp->rxrings = NULL;
+	sp->txrings = NULL;
+	kmem_cache_destroy(sp->chunk_cache);
+	sp->chunk_cache = NULL;
+}
+
+
+/*
+ * The queue pair count is fixed for the life of the instance, and so is
+ * the cache of DMA chunks the ring buffers come from.
+ */
+static int
+virtionet_rings_alloc(virtionet_state_t *sp)
+{
+	char			name[32];
+
+	(void) snprintf(name, sizeof (name), "virtionet%d_chunk",
+	    ddi_get_instance(sp->dip));
+	sp->chunk_cache = kmem_cache_create(name, sizeof (virtionet_dma_t), 0,
+	    virtionet_chunk_ctor, virtionet_chunk_dtor, NULL, sp, NULL, 0);
+
+	sp->rxrings = kmem_zalloc(sp->nqpairs * sizeof (virtionet_rxring_t),
+	    KM_SLEEP);
+	sp->txrings = kmem_zalloc(sp->nqpairs * sizeof (virtionet_txring_t),
+	    KM_SLEEP);
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		sp->rxrings[i].rr_sp = sp;
+		sp->rxrings[i].rr_index = i;
+		sp->txrings[i].tr_sp = sp;
+		sp->txrings[i].tr_index = i;
 	}
 
-	sp->rxq->vr_avail->idx = 0;
+	return (DDI_SUCCESS);
+}
+
 
-	/* Tx VQ ring */
-	for (int i = 0; i < sp->txq->vq_size; i++) {
-		sp->txq->vr_desc[i].addr =
-		    sp->txbuf->cookie.dmac_laddress + i * 2048;
-		sp->txq->vr_desc[i].len = 2048;
-		sp->txq->vr_desc[i].flags = 0;
-		sp->txq->vr_desc[i].next = 0;
+static void
+virtionet_locks_init(virtionet_state_t *sp)
+{
+	mutex_init(&sp->lock, NULL, MUTEX_DRIVER, DDI_INTR_PRI(sp->intr_pri));
+	mutex_init(&sp->imod_lock, NULL, MUTEX_DRIVER,
+	    DDI_INTR_PRI(sp->intr_pri));
+	/* Never taken in interrupt context, commands sleep holding it */
+	mutex_init(&sp->ctl_lock, NULL, MUTEX_DRIVER, NULL);
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		mutex_init(&sp->rxrings[i].rr_lock, NULL, MUTEX_DRIVER,
+		    DDI_INTR_PRI(sp->intr_pri));
+		mutex_init(&sp->txrings[i].tr_lock, NULL, MUTEX_DRIVER,
+		    DDI_INTR_PRI(sp->intr_pri));
 	}
+}
 
-	sp->txq->vr_avail->idx = 0;
 
-	/* Control VQ ring */
-	for (int i = 0; i < sp->ctlq->vq_size; i++) {
-		sp->ctlq->vr_desc[i].addr =
-		    sp->ctlbuf->cookie.dmac_laddress + i * 128;
-		sp->ctlq->vr_desc[i].len = 128;
-		sp->ctlq->vr_desc[i].flags = 0;
-		sp->ctlq->vr_desc[i].next = 0;
+static void
+virtionet_locks_destroy(virtionet_state_t *sp)
+{
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		mutex_destroy(&sp->rxrings[i].rr_lock);
+		mutex_destroy(&sp->txrings[i].tr_lock);
 	}
+	mutex_destroy(&sp->ctl_lock);
+	mutex_destroy(&sp->imod_lock);
+	mutex_destroy(&sp->lock);
+}
 
-	sp->ctlq->vr_avail->idx = 0;
 
-	return (DDI_SUCCESS);
+static void
+virtionet_softints_remove(virtionet_state_t *sp)
+{
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		if (sp->rxrings[i].rr_softint != NULL) {
+			(void) ddi_intr_remove_softint(
+			    sp->rxrings[i].rr_softint);
+			sp->rxrings[i].rr_softint = NULL;
+		}
+	}
 }
 
 
+/*
+ * The locks are left to virtionet_locks_destroy(), once the rings they
+ * protect are gone.
+ */
 static int
 virtionet_intr_setup(virtionet_state_t *sp)
 {
@@ -1050,7 +5000,40 @@ virtionet_intr_setup(virtionet_state_t *sp)
 	if (itypes & DDI_INTR_TYPE_FIXED) {
 		cmn_err(CE_NOTE, "Detected FIXED interrupt support");
 	}
-	rc = virtio_fixed_intr_setup(sp, virtionet_intr);
+
+	/* Legacy virtio knows nothing about MSI, only MSI-X and FIXED */
+	rc = DDI_FAILURE;
+	if (itypes & DDI_INTR_TYPE_MSIX) {
+		rc = virtio_msix_intr_setup(sp);
+	}
+	if (rc != DDI_SUCCESS) {
+		rc = virtio_fixed_intr_setup(sp, virtionet_intr);
+	}
+	if (rc != DDI_SUCCESS) {
+		return (DDI_FAILURE);
+	}
+
+	/* The handlers take the locks, at the interrupt priority */
+	virtionet_locks_init(sp);
+
+	/* Delivers the Rx work found when a ring leaves polling */
+	for (uint_t i = 0; i < sp->nqpairs; i++) {
+		if (ddi_intr_add_softint(sp->dip, &sp->rxrings[i].rr_softint,
+		    DDI_INTR_SOFTPRI_DEFAULT, virtionet_rx_intr,
+		    (caddr_t)&sp->rxrings[i]) != DDI_SUCCESS) {
+			(void) virtio_intr_teardown(sp);
+			virtionet_softints_remove(sp);
+			virtionet_locks_destroy(sp);
+			return (DDI_FAILURE);
+		}
+	}
+
+	/*
+	 * Enabling MSI-X moves the device specific configuration, so this
+	 * has to be done before it is read.
+	 */
+	virtionet_intr_enable(sp);
+
 	return (DDI_SUCCESS);
 }
 
@@ -1060,7 +5043,9 @@ virtionet_intr_teardown(virtionet_state_t *sp)
 {
 	int			rc;
 
+	/* No handler may run on the rings once this returns */
 	rc = virtio_intr_teardown(sp);
+	virtionet_softints_remove(sp);
 	return (DDI_SUCCESS);
 }
 
@@ -1094,41 +5079,12 @@ virtionet_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
 	ASSERT(sp);
 	sp->dip = dip;
 
-	/* Map virtionet PCI header */
-	rc = ddi_regs_map_setup(sp->dip, 1, &sp->hdraddr, 0,
-	    VIRTIO_DEVICE_SPECIFIC, &virtio_devattr, &sp->hdrhandle);
+	rc = virtio_regs_setup(sp);
 	if (rc != DDI_SUCCESS) {
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
 
-	/*
-	 * The device specific portion is *always* in guest native mode,
-	 * so it can be accessed directly, w/o ddi_get()/ddi_put() machinery.
-	 */
-	/* Map virtionet device specific configuration area */
-	off_t	len;
-	if (ddi_dev_regsize(sp->dip, 1, &len) != DDI_SUCCESS) {
-		ddi_regs_map_free(&sp->hdrhandle);
-		ddi_soft_state_free(virtionet_statep, instance);
-		return (DDI_FAILURE);
-	}
-	rc = ddi_regs_map_setup(sp->dip, 1, &sp->devaddr,
-	    VIRTIO_DEVICE_SPECIFIC, len - VIRTIO_DEVICE_SPECIFIC,
-	    &virtio_devattr, &sp->devhandle);
-	if (rc != DDI_SUCCESS) {
-		ddi_regs_map_free(&sp->hdrhandle);
-		ddi_soft_state_free(virtionet_statep, instance);
-		return (DDI_FAILURE);
-	}
-
-	cmn_err(CE_CONT, "PCI header %p, device specific %p\n",
-	    sp->hdraddr, sp->devaddr);
-/*
-	sp->devcfg =
-	    (virtio_net_config_t *)(sp->hdraddr + VIRTIO_DEVICE_SPECIFIC);
-*/
-
 	/* Reset device - we are going to re-negotiate feature set */
 	VIRTIO_DEV_RESET(sp);
 
@@ -1137,47 +5093,86 @@ virtionet_attach(dev_info_t *dip, ddi_attach_cmd_t cmd)
 
 	rc = virtio_validate_netdev(sp);
 	if (rc != DDI_SUCCESS) {
-		ddi_regs_map_free(&sp->devhandle);
-		ddi_regs_map_free(&sp->hdrhandle);
+		virtio_regs_teardown(sp);
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
 	/* We know how to drive this device */
 	VIRTIO_DEV_DRIVER(sp);
 
+	/*
+	 * From here on the device may have accepted features and queues, it
+	 * has to be reset before anything it may DMA into is freed.
+	 */
 	rc = virtionet_negotiate_features(sp);
 	if (rc != DDI_SUCCESS) {
-		ddi_regs_map_free(&sp->devhandle);
-		ddi_regs_map_free(&sp->hdrhandle);
+		VIRTIO_DEV_RESET(sp);
+		virtio_regs_teardown(sp);
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
 
-	virtionet_get_macaddr(sp);
-
-	rc = virtionet_vq_setup(sp);
+	virtionet_get_qpairs(sp);
+	rc = virtionet_rings_alloc(sp);
 	if (rc != DDI_SUCCESS) {
-		ddi_regs_map_free(&sp->devhandle);
-		ddi_regs_map_free(&sp->hdrhandle);
+		VIRTIO_DEV_RESET(sp);
+		virtio_regs_teardown(sp);
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
 
 	rc = virtionet_intr_setup(sp);
 	if (rc != DDI_SUCCESS) {
-		virtionet_vq_teardown(sp);
-		ddi_regs_map_free(&sp->devhandle);
-		ddi_regs_map_free(&sp->hdrhandle);
+		VIRTIO_DEV_RESET(sp);
+		virtionet_rings_free(sp);
+		virtio_regs_teardown(sp);
+		ddi_soft_state_free(virtionet_statep, instance);
+		return (DDI_FAILURE);
+	}
+
+	/*
+	 * The device specific portion is *always* in guest native mode,
+	 * so it can be accessed directly, w/o ddi_get()/ddi_put() machinery.
+	 * With the legacy interface it moves past the MSI-X vector
+	 * registers once MSI-X is enabled.
+	 */
+	if (!sp->modern && (sp->intr_type == DDI_INTR_TYPE_MSIX)) {
+		sp->devaddr = sp->hdraddr + VIRTIO_DEVICE_SPECIFIC_MSIX;
+	}
+
+	cmn_err(CE_CONT, "%s PCI header %p, device specific %p, "
+	    "%u queue pairs\n", sp->modern ? "Modern" : "Legacy",
+	    sp->hdraddr, sp->devaddr, sp->nqpairs);
+
+	virtionet_get_macaddr(sp);
+	virtionet_get_mtu(sp);
+	virtionet_get_qsizes(sp);
+
+	sp->imod_mode = virtionet_imod_mode;
+	sp->imod_high = virtionet_imod_high_rate;
+	sp->imod_low = virtionet_imod_low_rate;
+	sp->imod_usec = virtionet_imod_usec;
+
+	rc = virtionet_vq_setup(sp);
+	if (rc != DDI_SUCCESS) {
+		VIRTIO_DEV_RESET(sp);
+		(void) virtionet_intr_teardown(sp);
+		virtionet_locks_destroy(sp);
+		virtionet_rings_free(sp);
+		virtio_regs_teardown(sp);
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
 
 	rc = virtionet_mac_register(sp);
 	if (rc != DDI_SUCCESS) {
+		VIRTIO_DEV_RESET(sp);
+		virtionet_imod_stop(sp);
 		(void) virtionet_intr_teardown(sp);
 		virtionet_vq_teardown(sp);
-		ddi_regs_map_free(&sp->devhandle);
-		ddi_regs_map_free(&sp->hdrhandle);
+		virtionet_locks_destroy(sp);
+		virtionet_rings_free(sp);
+		virtio_regs_teardown(sp);
 		ddi_soft_state_free(virtionet_statep, instance);
 		return (DDI_FAILURE);
 	}
@@ -1208,15 +5203,25 @@ virtionet_detach(dev_info_t *dip, ddi_detach_cmd_t cmd)
 
 	ASSERT(sp);
 
+	/* Can't release Rx buffers the stack still holds */
+	if (sp->rx_nloaned != 0) {
+		return (DDI_FAILURE);
+	}
+
 	rc = virtionet_mac_unregister(sp);
 	if (rc != DDI_SUCCESS) {
 		return (DDI_FAILURE);
 	}
 
+	/* Stop the device and the moderation timer using the rings */
+	VIRTIO_DEV_RESET(sp);
+	virtionet_imod_stop(sp);
+
 	(void) virtionet_intr_teardown(sp);
 	virtionet_vq_teardown(sp);
-	ddi_regs_map_free(&sp->devhandle);
-	ddi_regs_map_free(&sp->hdrhandle);
+	virtionet_locks_destroy(sp);
+	virtionet_rings_free(sp);
+	virtio_regs_teardown(sp);
 	ddi_soft_state_free(virtionet_statep, instance);
 
 	return (DDI_SUCCESS);
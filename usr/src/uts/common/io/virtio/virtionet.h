@@ -31,9 +31,23 @@ extern "C" {
 /* Bitfield of features supported by our implementation */
 #define	VIRTIONET_GUEST_FEATURES	\
 			( \
-			VIRTIO_NET_F_MAC \
+			VIRTIO_NET_F_CSUM \
+			| VIRTIO_NET_F_GUEST_CSUM \
+			| VIRTIO_NET_F_MTU \
+			| VIRTIO_NET_F_MAC \
+			| VIRTIO_NET_F_GUEST_TSO4 \
+			| VIRTIO_NET_F_GUEST_TSO6 \
+			| VIRTIO_NET_F_GUEST_ECN \
+			| VIRTIO_NET_F_HOST_TSO4 \
+			| VIRTIO_NET_F_HOST_TSO6 \
+			| VIRTIO_NET_F_MRG_RXBUF \
 			| VIRTIO_NET_F_STATUS \
 			| VIRTIO_NET_F_CTRL_VQ \
+			| VIRTIO_NET_F_MQ \
+			| VIRTIO_F_RING_INDIRECT_DESC \
+			| VIRTIO_F_RING_EVENT_IDX \
+			| VIRTIO_F_RING_PACKED \
+			| VIRTIO_F_VERSION_1 \
 			)
 #ifdef __cplusplus
 }
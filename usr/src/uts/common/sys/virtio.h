@@ -35,13 +35,16 @@
 /*
  * Virtio Definitions
  *
- * See Virtio PCI Card Specification v0.8.10
+ * See Virtio PCI Card Specification v0.8.10 for the legacy interface and
+ * Virtual I/O Device (VIRTIO) Version 1.0 for the modern one
  */
 
 /* Virtio PCI configuration definitions */
 #define	VIRTIO_PCI_VENDOR		0x1AF4
 #define	VIRTIO_PCI_DEVID_MIN		0x1000
 #define	VIRTIO_PCI_DEVID_MAX		0x103F
+#define	VIRTIO_PCI_DEVID_MODERN		0x1040	/* Plus the subsystem id */
+#define	VIRTIO_PCI_DEVID_MODERN_MAX	0x107F
 #define	VIRTIO_PCI_SUBSYS_NETWORK	0x0001
 #define	VIRTIO_PCI_SUBSYS_BLOCK		0x0002
 #define	VIRTIO_PCI_SUBSYS_CONSOLE	0x0003
@@ -50,6 +53,7 @@
 #define	VIRTIO_PCI_SUBSYS_IOMEMORY	0x0006
 #define	VIRTIO_PCI_SUBSYS_9P		0x0009
 #define	VIRTIO_PCI_REV_ABIV0		0x0000
+#define	VIRTIO_PCI_REV_ABIV1		0x0001
 
 /* Virtio Header offsets */
 #define	VIRTIO_DEVICE_FEATURES		0x00000000	/* RO */
@@ -63,11 +67,53 @@
 #define	VIRTIO_MSIX_CONFIG_VECTOR	0x00000014	/* RW */
 #define	VIRTIO_MSIX_QUEUE_VECTOR	0x00000016	/* RW */
 #define	VIRTIO_DEVICE_SPECIFIC		0x00000014	/* Or 0x18 */
+#define	VIRTIO_DEVICE_SPECIFIC_MSIX	0x00000018	/* With MSI-X enabled */
+
+/* MSI-X vector meaning the interrupt is not used */
+#define	VIRTIO_MSI_NO_VECTOR		0xFFFF
+
+
+/*
+ * Modern devices describe where their configuration structures are with
+ * vendor specific PCI capabilities, offsets within struct virtio_pci_cap
+ */
+#define	VIRTIO_PCI_CAP_CFG_TYPE		0x03
+#define	VIRTIO_PCI_CAP_BAR		0x04
+#define	VIRTIO_PCI_CAP_OFFSET		0x08
+#define	VIRTIO_PCI_CAP_LENGTH		0x0C
+#define	VIRTIO_PCI_CAP_NOTIFY_MULT	0x10	/* Notify capability only */
+
+/* Capability cfg_type values */
+#define	VIRTIO_PCI_CAP_COMMON_CFG	1
+#define	VIRTIO_PCI_CAP_NOTIFY_CFG	2
+#define	VIRTIO_PCI_CAP_ISR_CFG		3
+#define	VIRTIO_PCI_CAP_DEVICE_CFG	4
+
+/* Common configuration structure offsets */
+#define	VIRTIO_COMMON_DEVICE_FEATURES_SEL 0x00	/* RW */
+#define	VIRTIO_COMMON_DEVICE_FEATURES	0x04	/* RO */
+#define	VIRTIO_COMMON_GUEST_FEATURES_SEL 0x08	/* RW */
+#define	VIRTIO_COMMON_GUEST_FEATURES	0x0C	/* RW */
+#define	VIRTIO_COMMON_MSIX_CONFIG_VECTOR 0x10	/* RW */
+#define	VIRTIO_COMMON_NUM_QUEUES	0x12	/* RO */
+#define	VIRTIO_COMMON_DEVICE_STATUS	0x14	/* RW */
+#define	VIRTIO_COMMON_CONFIG_GENERATION	0x15	/* RO */
+#define	VIRTIO_COMMON_QUEUE_SELECT	0x16	/* RW */
+#define	VIRTIO_COMMON_QUEUE_SIZE	0x18	/* RW */
+#define	VIRTIO_COMMON_MSIX_QUEUE_VECTOR	0x1A	/* RW */
+#define	VIRTIO_COMMON_QUEUE_ENABLE	0x1C	/* RW */
+#define	VIRTIO_COMMON_QUEUE_NOTIFY_OFF	0x1E	/* RO */
+#define	VIRTIO_COMMON_QUEUE_DESC	0x20	/* RW, 64 bit */
+#define	VIRTIO_COMMON_QUEUE_AVAIL	0x28	/* RW, 64 bit */
+#define	VIRTIO_COMMON_QUEUE_USED	0x30	/* RW, 64 bit */
 
 
 /* Virtio device-independent features */
 #define	VIRTIO_F_NOTIFY_ON_EMPTY	0x01000000U
 #define	VIRTIO_F_RING_INDIRECT_DESC	0x10000000U
+#define	VIRTIO_F_RING_EVENT_IDX		0x20000000U
+#define	VIRTIO_F_VERSION_1		0x0000000100000000ULL
+#define	VIRTIO_F_RING_PACKED		0x0000000400000000ULL
 #define	VIRTIO_F_BAD_FEATURE		0x40000000U
 
 
@@ -75,6 +121,7 @@
 #define	VIRTIO_DEV_STATUS_ACK		0x01
 #define	VIRTIO_DEV_STATUS_DRIVER	0x02
 #define	VIRTIO_DEV_STATUS_DRIVER_OK	0x04
+#define	VIRTIO_DEV_STATUS_FEATURES_OK	0x08	/* Modern devices only */
 #define	VIRTIO_DEV_STATUS_FAILED	0x80
 
 
@@ -86,6 +133,7 @@
 /* Virtio network device features */
 #define	VIRTIO_NET_F_CSUM		0x00000001U
 #define	VIRTIO_NET_F_GUEST_CSUM		0x00000002U
+#define	VIRTIO_NET_F_MTU		0x00000008U
 #define	VIRTIO_NET_F_MAC		0x00000020U
 #define	VIRTIO_NET_F_GSO		0x00000040U
 #define	VIRTIO_NET_F_GUEST_TSO4		0x00000080U
@@ -101,6 +149,7 @@
 #define	VIRTIO_NET_F_CTRL_VQ		0x00020000U
 #define	VIRTIO_NET_F_CTRL_RX		0x00040000U
 #define	VIRTIO_NET_F_CTRL_VLAN		0x00080000U
+#define	VIRTIO_NET_F_MQ			0x00400000U
 
 /* Virtio network device configuration status field bits */
 #define	VIRTIO_NET_S_LINK_UP		0x0001
@@ -108,11 +157,15 @@
 typedef struct virtio_net_config {
 	uint8_t		mac[6];
 	uint16_t	status;
+	uint16_t	max_virtqueue_pairs;
+	uint16_t	mtu;		/* Only if VIRTIO_NET_F_MTU */
 } virtio_net_config_t;
 
 /* Offsets for the above struct */
 #define	VIRTIO_NET_CFG_MAC		0x0000
 #define	VIRTIO_NET_CFG_STATUS		0x0006
+#define	VIRTIO_NET_CFG_MAX_VQ_PAIRS	0x0008
+#define	VIRTIO_NET_CFG_MTU		0x000A
 
 /* Network packet header for Rx and Tx queues */
 typedef struct virtio_net_hdr {
@@ -133,6 +186,8 @@ typedef struct virtio_net_hdr_rxbuf {
 /* virtio_net_hdr.flags */
 /* This packet requires calculation of the checksum */
 #define	VIRTIO_NET_HDR_F_NEEDS_CSUM	1
+/* The checksum has been validated by the device */
+#define	VIRTIO_NET_HDR_F_DATA_VALID	2
 
 /* virtio_net_hdr.gso_types */
 #define	VIRTIO_NET_HDR_GSO_NONE		0
@@ -149,10 +204,20 @@ typedef struct virtio_net_ctrl {
 	uint8_t		ack;
 } virtio_net_ctrl_t;
 
+/* Header of a control queue command */
+typedef struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} virtio_net_ctrl_hdr_t;
+
 /* Ack values for device to report back */
 #define	VIRTIO_NET_OK			0
 #define	VIRTIO_NET_ERR			1
 
+/* Control classes and commands */
+#define	VIRTIO_NET_CTRL_MQ		4
+#define	VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
+
 
 /* Virtio block device features */
 #define	VIRTIO_BLK_F_BARRIER		0x00000001
@@ -86,11 +86,54 @@ typedef struct vring_used {
 /* Similar to the vring_avail - means device needs not our notification */
 #define	VRING_USED_F_NO_NOTIFY		0x0001
 
+/*
+ * With VIRTIO_F_RING_EVENT_IDX each side publishes, right after its ring,
+ * the index at which it wants to hear from the other one next: used_event
+ * at the end of the avail ring, avail_event at the end of the used ring.
+ * The sizes below always leave room for them.
+ */
+#define	VRING_USED_EVENT(avail, n)	((avail)->ring[n])
+#define	VRING_AVAIL_EVENT(used, n)	(*(uint16_t *)&(used)->ring[n])
+
+/* True if moving the index from 'old' to 'new' passes 'event' */
+#define	VRING_NEED_EVENT(event, new, old)	\
+	((uint16_t)((new) - (event) - 1) < (uint16_t)((new) - (old)))
+
 #define	VRING_DTABLE_SIZE(n)	(sizeof (vring_desc_t) * n)
 #define	VRING_AVAIL_SIZE(n)	(sizeof (vring_avail_t) + \
-					(n - 1) * sizeof (uint16_t))
+					n * sizeof (uint16_t))
 #define	VRING_USED_SIZE(n)	(sizeof (vring_used_t) + \
-					(n - 1) * sizeof (vring_used_elem_t))
+					(n - 1) * sizeof (vring_used_elem_t) + \
+					sizeof (uint16_t))
+
+/*
+ * Packed ring (VIRTIO_F_RING_PACKED). A single descriptor ring is shared
+ * both ways: the driver makes descriptors available by flipping their
+ * AVAIL/USED flags to match its wrap counter, the device writes used
+ * descriptors back in place. The buffer ID identifies the chain.
+ */
+typedef struct vring_packed_desc {
+	uint64_t	addr;		/* Address (guest-physical)	*/
+	uint32_t	len;		/* Length			*/
+	uint16_t	id;		/* Buffer ID			*/
+	uint16_t	flags;		/* Flag values; see above/below	*/
+} vring_packed_desc_t;
+
+#define	VRING_PACKED_DESC_F_AVAIL	0x0080
+#define	VRING_PACKED_DESC_F_USED	0x8000
+
+/* Event suppression, one written by the driver, one by the device */
+typedef struct vring_packed_event {
+	uint16_t	off_wrap;	/* descriptor offset, wrap counter */
+	uint16_t	flags;
+} vring_packed_event_t;
+
+#define	VRING_PACKED_EVENT_F_ENABLE	0x0
+#define	VRING_PACKED_EVENT_F_DISABLE	0x1
+#define	VRING_PACKED_EVENT_F_DESC	0x2	/* VIRTIO_F_RING_EVENT_IDX */
+#define	VRING_PACKED_EVENT_WRAP_SHIFT	15
+
+#define	VRING_PACKED_DTABLE_SIZE(n)	(sizeof (vring_packed_desc_t) * n)
 
 #define	VRING_ROUNDUP(n)	((n + VIRTIO_VQ_PCI_ALIGN - 1) & \
 					~(VIRTIO_VQ_PCI_ALIGN - 1))